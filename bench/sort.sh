@@ -0,0 +1,61 @@
+#!/bin/sh
+#
+# Times bsdiff --build-index on inputs that are hard on suffix sorts:
+#   bench/sort.sh [bsdiff options, e.g. -s sais or -j 4]
+# Run it from the top of the tree after make. The inputs are generated in a
+# temporary directory, SIZE_MB MiB each (16 by default), and BSDIFF points
+# to the bsdiff to time.
+#
+set -e
+
+BSDIFF=${BSDIFF:-./bsdiff}
+MB=${SIZE_MB:-16}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+# $1 KiB of the byte of octal value $2
+fill()
+{
+  head -c $(($1 << 10)) /dev/zero | tr '\000' "\\$2"
+}
+
+random()
+{
+  head -c $(($1 << 10)) /dev/urandom
+}
+
+# Each MiB is random data followed by padding
+padded()
+{
+  i=0
+  while [ $i -lt "$MB" ]; do
+    random 256
+    "$@"
+    i=$((i + 1))
+  done
+}
+
+# zeros: a single run
+fill $((MB << 10)) 000 > "$DIR/zeros"
+# ff_pad: random data padded with 0xff
+padded fill 768 377 > "$DIR/ff_pad"
+# pad_mixed: random data padded with zeros, then 0xff
+padded eval 'fill 384 000; fill 384 377' > "$DIR/pad_mixed"
+# runs: three runs of 3 MiB of different bytes
+{ fill 3072 141; fill 3072 142; fill 3072 143; } > "$DIR/runs"
+# periodic4k: the same 4 KiB over and over
+random 4 > "$DIR/periodic4k"
+while [ "$(wc -c < "$DIR/periodic4k")" -lt $((MB << 20)) ]; do
+  cat "$DIR/periodic4k" "$DIR/periodic4k" > "$DIR/tmp"
+  mv "$DIR/tmp" "$DIR/periodic4k"
+done
+# random, for reference
+random $((MB << 10)) > "$DIR/random"
+
+for input in zeros ff_pad pad_mixed runs periodic4k random; do
+  start=$(date +%s%N)
+  "$BSDIFF" "$@" --build-index "$DIR/$input" "$DIR/index"
+  end=$(date +%s%N)
+  ms=$(((end - start) / 1000000))
+  printf '%-12s %4d.%02d s\n' "$input" $((ms / 1000)) $((ms % 1000 / 10))
+done
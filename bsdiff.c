@@ -26,473 +26,1938 @@
  */
 
 #include "bsdiff.h"
+#include "bsdiff_simd.h"
+#include "codec.h"
+#include "threadpool.h"
 
 #include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <sys/types.h>
-#include <bzlib.h>
+#include <time.h>
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#define MAX(x, y) (((x) > (y)) ? (x) : (y))
 
-static int bz2_write(BZFILE* bz2, const void* buffer, int size);
+#if defined(__GNUC__)
+# define SA_PREFETCH(p) __builtin_prefetch(p)
+#else
+# define SA_PREFETCH(p) ((void)(p))
+#endif
 
-static void split(int64_t* I, int64_t* V, int64_t start, int64_t len, int64_t h)
+static int64_t matchlen(const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize)
+{
+  return simd_matchlen(old, new, MIN(oldsize, newsize));
+}
+
+/*
+ * Progress, cancellation and time budget (see bsdiff_options). The sorts and
+ * the scans check in with their watch every so often: past sort_deadline,
+ * half of the budget, the suffix sort gives up and the hash engine diffs
+ * instead. Past scan_deadline, most of the budget, the scans stop searching
+ * and diff whatever is left of new along their last match, which is fast.
+ * The sort checks the clock about every WATCH_SORT_PERIOD, from its tasks
+ * too, so that the hash engine still gets the rest of the budget.
+ */
+#define WATCH_INTERVAL (1 << 16) // Bytes of new scanned between checks
+#define WATCH_SORT_PERIOD 0.01 // Seconds between checks of the sort
+#define WATCH_SORT_STRIDE (1 << 12) // Suffixes walked before the first check
+
+struct bsdiff_watch
+{
+  const struct bsdiff_options* opts;
+  pthread_mutex_t lock; // Parallel scans check in from every thread
+  double sort_deadline; // Seconds on CLOCK_MONOTONIC, 0 for none
+  double scan_deadline;
+  atomic_int expired; // First result of watch_sort_check() that was not 0
+  int64_t scanned;
+  int64_t total; // newsize, 0 when it is not known yet
+};
+
+static double watch_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void watch_init(struct bsdiff_watch* w, const struct bsdiff_options* opts, int64_t total)
+{
+  const double now = watch_now();
+
+  w->opts = opts;
+  pthread_mutex_init(&w->lock, NULL);
+  w->sort_deadline = (opts->time_budget > 0) ? now + opts->time_budget * 0.5 : 0;
+  w->scan_deadline = (opts->time_budget > 0) ? now + opts->time_budget * 0.9 : 0;
+  atomic_init(&w->expired, 0);
+  w->scanned = 0;
+  w->total = total;
+}
+
+static void watch_destroy(struct bsdiff_watch* w)
+{
+  pthread_mutex_destroy(&w->lock);
+}
+
+// -1 when cancelled, 1 past deadline, 0 otherwise
+static int watch_check(const struct bsdiff_watch* w, double deadline)
+{
+  if (w->opts->cancel != NULL && *w->opts->cancel)
+    return -1;
+  return (deadline > 0 && watch_now() > deadline) ? 1 : 0;
+}
+
+// Whether a thread already found the sort cancelled or out of time
+static int watch_expired(struct bsdiff_watch* w)
+{
+  return atomic_load_explicit(&w->expired, memory_order_relaxed);
+}
+
+// watch_check() against the sort deadline, from any thread: once one of
+// them finds the sort cancelled or out of time, the others stop at their
+// next check with the same result
+static int watch_sort_check(struct bsdiff_watch* w)
+{
+  int expired = watch_expired(w);
+  int first = 0;
+
+  if (expired == 0 && (expired = watch_check(w, w->sort_deadline)) != 0 &&
+      !atomic_compare_exchange_strong(&w->expired, &first, expired))
+    expired = first;
+
+  return expired;
+}
+
+// Spaces the checks of a sort loop in time rather than in suffixes, which
+// take from nanoseconds to microseconds each depending on old
+struct watch_stride
+{
+  int64_t next;   // Position of the next check
+  int64_t stride; // Suffixes walked between checks
+  double last;
+};
+
+static void watch_stride_init(struct watch_stride* s)
+{
+  s->next = WATCH_SORT_STRIDE;
+  s->stride = WATCH_SORT_STRIDE;
+  s->last = watch_now();
+}
+
+// Check at position at, and place the next check about WATCH_SORT_PERIOD
+// later
+static int watch_stride(struct bsdiff_watch* w, struct watch_stride* s, int64_t at)
+{
+  const double now = watch_now();
+
+  if (now - s->last < WATCH_SORT_PERIOD / 2)
+    s->stride *= 2;
+  else if (now - s->last > WATCH_SORT_PERIOD * 2 && s->stride > 1)
+    s->stride /= 2;
+  s->last = now;
+  s->next = at + s->stride;
+
+  return watch_sort_check(w);
+}
+
+static void watch_progress(struct bsdiff_watch* w, enum bsdiff_stage stage, int64_t done, int64_t total)
+{
+  if (w->opts->progress == NULL)
+    return;
+  pthread_mutex_lock(&w->lock);
+  w->opts->progress(w->opts->progress_opaque, stage, done, total);
+  pthread_mutex_unlock(&w->lock);
+}
+
+// After a round of the sort, done suffixes out of total being sorted
+static int watch_sort(struct bsdiff_watch* w, int64_t done, int64_t total)
+{
+  watch_progress(w, BSDIFF_STAGE_SORT, done, total);
+  return watch_sort_check(w);
+}
+
+// After bytes more of new were scanned, by any thread
+static int watch_scan(struct bsdiff_watch* w, int64_t bytes)
+{
+  int64_t scanned;
+
+  pthread_mutex_lock(&w->lock);
+  scanned = (w->scanned += bytes);
+  if (w->opts->progress != NULL)
+    w->opts->progress(w->opts->progress_opaque, BSDIFF_STAGE_SCAN, scanned, w->total);
+  pthread_mutex_unlock(&w->lock);
+
+  return watch_check(w, w->scan_deadline);
+}
+
+#define saidx_t int32_t
+#define SA_FN(name) name##32
+#include "bsdiff_sa.h"
+#undef SA_FN
+#undef saidx_t
+
+#define saidx_t int64_t
+#define SA_FN(name) name##64
+#include "bsdiff_sa.h"
+#undef SA_FN
+#undef saidx_t
+
+// Suffix array engines. Each one fills I[0..oldsize] with the start of each
+// suffix of *old* in lexicographic order, I[0] being the empty suffix.
+// If rank is not NULL, it also sets *rank to the inverse of I, or to NULL
+// if it could not be allocated. They return 1, with neither I nor rank set,
+// when watch is past its sort deadline.
+// sort32 is used whenever oldsize fits (see SA_FITS_32).
+struct suffix_sort_engine
+{
+  const char* name;
+  int (*sort32)(int32_t* I, const uint8_t* old, int64_t oldsize, struct threadpool* pool, struct bsdiff_watch* watch, int32_t** rank);
+  int (*sort64)(int64_t* I, const uint8_t* old, int64_t oldsize, struct threadpool* pool, struct bsdiff_watch* watch, int64_t** rank);
+};
+
+static const struct suffix_sort_engine suffix_sort_engines[] =
+{
+  [BSDIFF_SUFSORT_QSUFSORT] = { "qsufsort", qsufsort32, qsufsort64 },
+  [BSDIFF_SUFSORT_SAIS]     = { "sais", sais32, sais64 },
+};
+
+#define SA_FITS_32(oldsize) ((oldsize) < INT32_MAX)
+
+#define SUFFIX_SORT_ENGINES (sizeof(suffix_sort_engines) / sizeof(suffix_sort_engines[0]))
+
+
+static void toLittleEndian(uint64_t x, uint8_t* buf)
+{
+  for (unsigned int i = 0; i < 8; i++)
+  {
+    buf[i] = x & 0xff;
+    x = x >> 8;
+  }
+}
+
+// Control fields are sign-magnitude, as decoded by offtin() in bspatch
+static void offtout(int64_t x, uint8_t* buf)
+{
+  toLittleEndian((x < 0) ? -x : x, buf);
+  if (x < 0)
+    buf[7] |= 0x80;
+}
+
+/*
+ * BSDIFF_CTRL_VARINT control channel: chunks made of their size on 4 bytes,
+ * little endian, and up to CTRL_CHUNK_SIZE bytes of whole records. A record
+ * is difflen and extralen as LEB128 varints, then the seek in old as a
+ * zigzag LEB128 varint. When the control records share their stream with
+ * other data, each chunk holds a single record so that it comes before its
+ * diff and extra data.
+ */
+#define CTRL_CHUNK_SIZE (1 << 14)
+#define CTRL_RECORD_MAX (3 * 10)
+
+struct ctrl_chunk
+{
+  uint8_t buffer[4 + CTRL_CHUNK_SIZE];
+  size_t used;  // Including the size
+  int single;   // One record per chunk
+};
+
+static size_t put_varint(uint64_t x, uint8_t* buf)
+{
+  size_t n = 0;
+
+  while (x >= 0x80)
+  {
+    buf[n++] = (x & 0x7f) | 0x80;
+    x >>= 7;
+  }
+  buf[n++] = x;
+
+  return n;
+}
+
+static uint64_t zigzag(int64_t x)
+{
+  return ((uint64_t)x << 1) ^ (uint64_t)(x >> 63);
+}
+
+/*
+ * Buffered output of one or more channels. Channels sharing a stream share
+ * a writer, which keeps their data in order. Everything reaches the stream
+ * in blocks of WRITE_BUFFER_SIZE bytes, or more for long extra spans.
+ */
+#define WRITE_BUFFER_SIZE (1 << 16)
+
+struct bsdiff_writer
+{
+  struct bsdiff_stream* stream;
+  uint8_t* buffer;
+  int64_t used;
+};
+
+static int writer_flush(struct bsdiff_writer* w)
+{
+  if (w->used > 0 && w->stream->write(w->stream, w->buffer, (int)w->used))
+    return -1;
+
+  w->used = 0;
+  return 0;
+}
+
+static int writer_write(struct bsdiff_writer* w, const void* data, int64_t length)
+{
+  const uint8_t* p = data;
+
+  if (w->used + length <= WRITE_BUFFER_SIZE)
+  {
+    memcpy(w->buffer + w->used, p, length);
+    w->used += length;
+    return 0;
+  }
+
+  if (writer_flush(w))
+    return -1;
+
+  // Too large to be worth copying
+  while (length > 0)
+  {
+    const int smallsize = (int)MIN(length, INT_MAX);
+    if (w->stream->write(w->stream, p, smallsize))
+      return -1;
+    length -= smallsize;
+    p += smallsize;
+  }
+
+  return 0;
+}
+
+// Write a[i] - b[i] for i < length, straight into the buffer
+static int writer_sub(struct bsdiff_writer* w, const uint8_t* a, const uint8_t* b, int64_t length)
+{
+  while (length > 0)
+  {
+    int64_t n;
+
+    if (w->used == WRITE_BUFFER_SIZE && writer_flush(w))
+      return -1;
+
+    n = MIN(length, WRITE_BUFFER_SIZE - w->used);
+    simd_sub(w->buffer + w->used, a, b, n);
+    w->used += n;
+    a += n;
+    b += n;
+    length -= n;
+  }
+
+  return 0;
+}
+
+struct bsdiff_request
+{
+  const uint8_t* old;
+  int64_t oldsize;
+  const uint8_t* new;
+  int64_t newsize;
+  struct bsdiff_writer* ctrl; // May all be the same writer
+  struct bsdiff_writer* diff;
+  struct bsdiff_writer* extra;
+  struct ctrl_chunk* chunk; // NULL for BSDIFF_CTRL_FIXED
+  const int32_t* I32; // Only one of I32 and I64 is set, depending on the index width
+  const int64_t* I64;
+  const int32_t* R32; // Inverse of I32 or I64, may be NULL (see search_near())
+  const int64_t* R64;
+  const int64_t* buckets; // See build_buckets(), may be NULL
+  const struct hash_index* hash; // Instead of I32 and I64 with BSDIFF_ENGINE_HASH
+  const struct bsdiff_options* opts;
+  struct threadpool* pool; // NULL when running on a single thread
+  struct bsdiff_watch* watch;
+  int64_t window; // Size of the old windows, 0 when old is diffed as a whole
+};
+
+/*
+ * For each 2-byte prefix p, buckets[2 * p] and buckets[2 * p + 1] bound the
+ * range of I holding the suffixes that start with p. It is computed from the
+ * byte pairs of old, without looking at I: I[0] is the empty suffix, then
+ * for each first byte comes the 1-byte suffix (if old ends with that byte)
+ * followed by the suffixes of each 2-byte prefix in order.
+ */
+#define PREFIX_BUCKETS 65536
+
+static int64_t* build_buckets(const uint8_t* old, int64_t oldsize)
+{
+  int64_t* buckets;
+  int64_t i, next;
+  int c, d;
+
+  if ((buckets = calloc(2 * PREFIX_BUCKETS, sizeof(int64_t))) == NULL)
+    return NULL;
+
+  for (i = 0; i + 1 < oldsize; i++)
+    buckets[2 * ((old[i] << 8) | old[i + 1]) + 1]++;
+
+  next = 1;
+  for (c = 0; c < 256; c++)
+  {
+    if (oldsize > 0 && old[oldsize - 1] == c)
+      next++;
+    for (d = 0; d < 256; d++)
+    {
+      int64_t* bucket = buckets + 2 * ((c << 8) | d);
+      bucket[0] = next;
+      next += bucket[1];
+      bucket[1] = next;
+    }
+  }
+
+  return buckets;
+}
+
+/*
+ * Hash engine (BSDIFF_ENGINE_HASH): instead of a suffix array, old is
+ * indexed by the hash of the HASH_BLOCK bytes at every HASH_STRIDE bytes,
+ * the first position of each hash only. A search hashes the first
+ * HASH_BLOCK bytes of new and extends the old block it finds, if any, so
+ * that exact matches are only found where old is stride aligned. The scan
+ * finds them at most HASH_STRIDE - 1 bytes late, and its backward extension
+ * makes up for it.
+ */
+#define HASH_BLOCK 32
+#define HASH_STRIDE 16
+
+struct hash_index
+{
+  uint64_t* keys; // 0 when empty
+  int64_t* pos;
+  size_t mask;
+};
+
+static uint64_t hash_block(const uint8_t* p)
+{
+  uint64_t w[4], h;
+
+  memcpy(w, p, sizeof(w));
+  h = w[0] * 0x9e3779b97f4a7c15ULL;
+  h = (h ^ (h >> 29) ^ w[1]) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 32) ^ w[2]) * 0x94d049bb133111ebULL;
+  h = (h ^ (h >> 29) ^ w[3]) * 0x9e3779b97f4a7c15ULL;
+
+  return (h ^ (h >> 32)) | 1;
+}
+
+static int hash_build(struct hash_index* index, const uint8_t* old, int64_t oldsize)
+{
+  size_t capacity = 1024, i;
+  uint64_t key;
+  int64_t k;
+
+  while (capacity < 2 * (size_t)(oldsize / HASH_STRIDE))
+    capacity *= 2;
+  index->mask = capacity - 1;
+  index->keys = calloc(capacity, sizeof(uint64_t));
+  index->pos = malloc(capacity * sizeof(int64_t));
+  if (index->keys == NULL || index->pos == NULL)
+    return -1;
+
+  for (k = 0; k + HASH_BLOCK <= oldsize; k += HASH_STRIDE)
+  {
+    key = hash_block(old + k);
+    for (i = key & index->mask; index->keys[i] != 0 && index->keys[i] != key; i = (i + 1) & index->mask)
+      ;
+    if (index->keys[i] == 0)
+    {
+      index->keys[i] = key;
+      index->pos[i] = k;
+    }
+  }
+
+  return 0;
+}
+
+static void hash_free(struct hash_index* index)
+{
+  free(index->keys);
+  free(index->pos);
+  index->keys = NULL;
+  index->pos = NULL;
+}
+
+static int64_t hash_search(const struct hash_index* index, const uint8_t* old, int64_t oldsize,
+                           const uint8_t* new, int64_t newsize, int64_t* pos)
+{
+  uint64_t key;
+  int64_t len;
+  size_t i;
+
+  if (newsize < HASH_BLOCK)
+    return 0;
+
+  key = hash_block(new);
+  for (i = key & index->mask; index->keys[i] != 0; i = (i + 1) & index->mask)
+  {
+    if (index->keys[i] != key)
+      continue;
+    // Hashes may collide, a block that does not match is no match
+    len = matchlen(old + index->pos[i], oldsize - index->pos[i], new, newsize);
+    if (len < HASH_BLOCK)
+      return 0;
+    *pos = index->pos[i];
+    return len;
+  }
+
+  return 0;
+}
+
+static int64_t search_index(const struct bsdiff_request* req, const uint8_t* new, int64_t newsize, int64_t* pos)
 {
-  int64_t i, j, k, x, tmp, jj, kk;
+  int64_t st = 0;
+  int64_t en = req->oldsize;
 
-  if (len < 16)
+  if (req->hash != NULL)
+    return hash_search(req->hash, req->old, req->oldsize, new, newsize, pos);
+
+  // Narrow the search to the suffixes sharing the first 2 bytes of new, or
+  // else its first byte.
+  if (req->buckets != NULL && newsize > 0 && req->oldsize > 0)
   {
-    for (k = start; k < start + len; k += j)
+    const int64_t* first = req->buckets + 2 * (new[0] << 8);
+    const int64_t* bucket = (newsize > 1) ? req->buckets + 2 * ((new[0] << 8) | new[1]) : first;
+
+    if (newsize > 1 && bucket[0] < bucket[1])
+    {
+      st = bucket[0];
+      en = bucket[1] - 1;
+    }
+    else
+    {
+      const int64_t lo = first[0] - ((req->old[req->oldsize - 1] == new[0]) ? 1 : 0);
+      const int64_t hi = first[2 * 255 + 1];
+      if (lo < hi)
       {
-      j = 1;
-      x = V[I[k] + h];
-      for (i = 1; k + i < start + len; i++)
+        st = lo;
+        en = hi - 1;
+      }
+    }
+  }
+
+  if (req->I32 != NULL)
+    return search32(req->I32, req->old, req->oldsize, new, newsize, st, en, pos);
+
+  return search64(req->I64, req->old, req->oldsize, new, newsize, st, en, pos);
+}
+
+// Where in old a scan of new[start...] should start from. The hash engine
+// only finds old blocks that start at a multiple of HASH_STRIDE, so it tries a
+// few more bytes of new and moves the match back to start.
+static int64_t search_start(const struct bsdiff_request* req, const uint8_t* new, int64_t newsize)
+{
+  int64_t pos = 0;
+  int64_t k;
+
+  if (req->hash == NULL)
+  {
+    search_index(req, new, newsize, &pos);
+    return pos;
+  }
+
+  for (k = 0; k < HASH_STRIDE && k < newsize; k++)
+    if (search_index(req, new + k, newsize - k, &pos) > 0)
+      return MAX(pos - k, 0);
+
+  return 0;
+}
+
+/*
+ * Same as search_index(), but start from old[hint], which is where the
+ * previous match would continue. When new is mostly old with a few bytes
+ * changed here and there, the best match is most often next to it in I and
+ * a few comparisons are enough to find it.
+ */
+#define NEAR_MIN_MATCH 16 // Shorter matches do not make good hints
+#define NEAR_MAX_STEPS 8  // Give up on hints more than 2^8 ranks away
+
+static int64_t search_near(const struct bsdiff_request* req, const uint8_t* new, int64_t newsize, int64_t hint, int64_t* pos)
+{
+  int64_t len = -1;
+
+  // Only follow the hint if it continues the match on new[0] at least
+  if (hint >= 0 && hint < req->oldsize && newsize > 0 && req->old[hint] == new[0])
+  {
+    if (req->R32 != NULL)
+      len = search_near32(req->I32, req->old, req->oldsize, new, newsize, req->R32[hint], NEAR_MAX_STEPS, pos);
+    else if (req->R64 != NULL)
+      len = search_near64(req->I64, req->old, req->oldsize, new, newsize, req->R64[hint], NEAR_MAX_STEPS, pos);
+  }
+
+  if (len < 0)
+    len = search_index(req, new, newsize, pos);
+
+  return len;
+}
+
+// One control record, with where its diff and extra data come from
+struct bsdiff_ctrl
+{
+  int64_t newpos;   // Start of the diff data in new, followed by the extra data
+  int64_t oldpos;   // Start of the diff data in old
+  int64_t difflen;
+  int64_t extralen;
+  int64_t nextpos;  // oldpos of the next record
+};
+
+typedef int (*bsdiff_emit)(void* ctx, const struct bsdiff_ctrl* ctrl);
+
+static int chunk_flush(const struct bsdiff_request* req)
+{
+  struct ctrl_chunk* chunk = req->chunk;
+  const size_t size = chunk->used - 4;
+
+  if (size == 0)
+    return 0;
+
+  chunk->buffer[0] = size & 0xff;
+  chunk->buffer[1] = (size >> 8) & 0xff;
+  chunk->buffer[2] = (size >> 16) & 0xff;
+  chunk->buffer[3] = (size >> 24) & 0xff;
+  chunk->used = 4;
+
+  return writer_write(req->ctrl, chunk->buffer, 4 + size);
+}
+
+static int write_ctrl(void* ctx, const struct bsdiff_ctrl* ctrl)
+{
+  const struct bsdiff_request* req = ctx;
+  struct ctrl_chunk* chunk = req->chunk;
+  const int64_t seek = ctrl->nextpos - (ctrl->oldpos + ctrl->difflen);
+  uint8_t buf[8 * 3];
+
+  /* Write control data */
+  if (chunk != NULL)
+  {
+    if (chunk->used + CTRL_RECORD_MAX > sizeof(chunk->buffer) && chunk_flush(req))
+      return -1;
+    chunk->used += put_varint(ctrl->difflen, chunk->buffer + chunk->used);
+    chunk->used += put_varint(ctrl->extralen, chunk->buffer + chunk->used);
+    chunk->used += put_varint(zigzag(seek), chunk->buffer + chunk->used);
+    if (chunk->single && chunk_flush(req))
+      return -1;
+  }
+  else
+  {
+    offtout(ctrl->difflen, buf);
+    offtout(ctrl->extralen, buf + 8);
+    offtout(seek, buf + 16);
+    if (writer_write(req->ctrl, buf, sizeof(buf)))
+      return -1;
+  }
+
+  /* Write diff data */
+  if (writer_sub(req->diff, req->new + ctrl->newpos, req->old + ctrl->oldpos, ctrl->difflen))
+    return -1;
+
+  /* Write extra data */
+  if (writer_write(req->extra, req->new + ctrl->newpos + ctrl->difflen, ctrl->extralen))
+    return -1;
+
+  return 0;
+}
+
+/*
+ * Compute the differences for new[start, end), starting from old[lastpos],
+ * and hand each control record to emit(). Matches are searched against the
+ * whole of new, but records never cover anything past end.
+ */
+static int scan_range(const struct bsdiff_request* req, int64_t start, int64_t end, int64_t lastpos, bsdiff_emit emit, void* ctx)
+{
+  int64_t scan, pos, len;
+  int64_t lastscan, lastoffset;
+  int64_t oldscore, scsc;
+  int64_t lenf, lenb;
+  int64_t overlap, lens;
+  int64_t hintscan, hintpos, hintlen;
+  int64_t checked = start; // Scanned bytes up to there were counted
+  int expired;
+  struct bsdiff_ctrl ctrl;
+
+  if ((expired = watch_scan(req->watch, 0)) < 0)
+    return -1;
+
+  scan = start;
+  len = 0;
+  pos = 0;
+  hintscan = hintpos = hintlen = 0;
+  lastscan = start;
+  lastoffset = lastpos - start;
+  while (scan < end)
+  {
+    oldscore = 0;
+
+    for (scsc = scan += len; scan < end; scan++)
+    {
+      if (scan - checked >= WATCH_INTERVAL)
       {
-        if (V[I[k + i] + h] < x)
-        {
-          x = V[I[k + i] + h];
-          j = 0;
-        }
-        if (V[I[k + i] + h] == x)
-        {
-          tmp = I[k + j];
-          I[k + j] = I[k + i];
-          I[k + i] = tmp;
-          j++;
-        }
+        if ((expired = watch_scan(req->watch, scan - checked)) < 0)
+          return -1;
+        checked = scan;
+      }
+
+      // Out of time: search once every WATCH_INTERVAL bytes only, each
+      // match running up to the next one that leaves its diagonal
+      if (expired)
+      {
+        scan = MIN(scan + WATCH_INTERVAL, end);
+        len = 0;
+        pos = (scan < end) ? search_start(req, req->new + scan, req->newsize - scan) : lastpos;
+        break;
+      }
+
+      // Follow the last long match for a while, past the bytes it missed
+      if (hintlen > 0 && scan - hintscan < hintlen + NEAR_MIN_MATCH)
+        len = search_near(req, req->new + scan, req->newsize - scan, hintpos + (scan - hintscan), &pos);
+      else
+        len = search_index(req, req->new + scan, req->newsize - scan, &pos);
+
+      if (len >= NEAR_MIN_MATCH)
+      {
+        hintscan = scan;
+        hintpos = pos;
+        hintlen = len;
+      }
+
+      if (scsc < scan + len)
+      {
+        const int64_t n = MIN(scan + len, req->oldsize - lastoffset) - scsc;
+        if (n > 0)
+          oldscore += simd_count_equal(req->old + scsc + lastoffset, req->new + scsc, n);
+        scsc = scan + len;
       }
-      for (i = 0; i < j; i++)
-        V[I[k + i]] = k + j - 1;
-      if (j == 1)
-        I[k] = -1;
+
+      if (((len == oldscore) && (len != 0)) || (len > oldscore + 8))
+        break;
+
+      if ((scan + lastoffset < req->oldsize) && (req->old[scan + lastoffset] == req->new[scan]))
+        oldscore--;
     }
-    return;
+
+    // The last match may run past the end of a segment, the next segment
+    // will find it again.
+    if (scan > end)
+      scan = end;
+
+    if ((len != oldscore) || (scan == end) || (expired && pos - scan != lastoffset))
+    {
+      // Extend the last match forward and the new one backward, as long as
+      // more than half of the bytes match
+      lenf = simd_extend(req->old + lastpos, req->new + lastscan, MIN(scan - lastscan, req->oldsize - lastpos), 0);
+
+      lenb = 0;
+      if (scan < end)
+        lenb = simd_extend(req->old + pos, req->new + scan, MIN(scan - lastscan, pos), 1);
+
+      if (lastscan + lenf > scan - lenb)
+      {
+        overlap = (lastscan + lenf) - (scan - lenb);
+        lens = simd_split(req->new + lastscan + lenf - overlap, req->old + lastpos + lenf - overlap,
+                          req->new + scan - lenb, req->old + pos - lenb, overlap);
+
+        lenf += lens - overlap;
+        lenb -= lens;
+      }
+
+      ctrl.newpos = lastscan;
+      ctrl.oldpos = lastpos;
+      ctrl.difflen = lenf;
+      ctrl.extralen = (scan - lenb) - (lastscan + lenf);
+      ctrl.nextpos = pos - lenb;
+      if (emit(ctx, &ctrl))
+        return -1;
+
+      lastscan = scan - lenb;
+      lastpos = pos - lenb;
+      lastoffset = pos - scan;
+    }
+  }
+
+  return (watch_scan(req->watch, end - checked) < 0) ? -1 : 0;
+}
+
+/*
+ * Parallel scan. new is cut into segments that are scanned independently,
+ * each one starting from the best match of its first bytes, and their
+ * control records are stitched together by pointing the last record of a
+ * segment at the first one of the next.
+ *
+ * The diff and extra data always add up to newsize, so the uncompressed
+ * patch only grows by the control records added at each boundary: usually
+ * one, 24 bytes. What may change is the split between diff and extra bytes
+ * around a boundary, since neither segment can extend an approximate match
+ * across it. This is bounded by the length of the match cut by the boundary,
+ * and SCAN_SEGMENT_MIN keeps the number of boundaries small.
+ */
+#define SCAN_SEGMENT_MIN (1 << 20)
+#define SCAN_SEGMENTS_PER_THREAD 4
+
+struct scan_segment
+{
+  const struct bsdiff_request* req;
+  int64_t start;
+  int64_t end;
+  struct bsdiff_ctrl* ctrl;
+  size_t count;
+  size_t capacity;
+  int status;
+};
+
+static int append_ctrl(void* ctx, const struct bsdiff_ctrl* ctrl)
+{
+  struct scan_segment* seg = ctx;
+
+  if (seg->count == seg->capacity)
+  {
+    size_t capacity = seg->capacity ? seg->capacity * 2 : 256;
+    struct bsdiff_ctrl* grown = realloc(seg->ctrl, capacity * sizeof(*grown));
+    if (grown == NULL)
+      return -1;
+    seg->ctrl = grown;
+    seg->capacity = capacity;
+  }
+  seg->ctrl[seg->count++] = *ctrl;
+
+  return 0;
+}
+
+static void scan_segment_task(void* ctx, int64_t index, int64_t unused)
+{
+  struct scan_segment* seg = (struct scan_segment*)ctx + index;
+  int64_t lastpos = 0;
+
+  (void)unused;
+  if (seg->start > 0)
+    lastpos = search_start(seg->req, seg->req->new + seg->start, seg->req->newsize - seg->start);
+  seg->status = scan_range(seg->req, seg->start, seg->end, lastpos, append_ctrl, seg);
+}
+
+static int scan_parallel(const struct bsdiff_request* req, int64_t segments, bsdiff_emit emit, void* ctx)
+{
+  struct scan_segment* seg;
+  int64_t k;
+  size_t n;
+  int result = 0;
+
+  if ((seg = calloc(segments, sizeof(*seg))) == NULL)
+    return -1;
+
+  for (k = 0; k < segments; k++)
+  {
+    seg[k].req = req;
+    seg[k].start = req->newsize * k / segments;
+    seg[k].end = req->newsize * (k + 1) / segments;
+    threadpool_submit(req->pool, scan_segment_task, seg, k, 0);
+  }
+  threadpool_wait(req->pool);
+
+  for (k = 0; k < segments && result == 0; k++)
+  {
+    // A cancelled or failed segment may not hold any record
+    if (seg[k].status != 0)
+    {
+      result = -1;
+      break;
+    }
+    // Every segment that succeeded holds at least one record
+    if (k + 1 < segments && seg[k].count > 0 && seg[k + 1].count > 0)
+      seg[k].ctrl[seg[k].count - 1].nextpos = seg[k + 1].ctrl[0].oldpos;
+    for (n = 0; n < seg[k].count && result == 0; n++)
+      result = emit(ctx, &seg[k].ctrl[n]);
+  }
+
+  for (k = 0; k < segments; k++)
+    free(seg[k].ctrl);
+  free(seg);
+
+  return result;
+}
+
+// Returns 1, with nothing to free, when watch is past its sort deadline
+static int sort_index(const uint8_t* old, int64_t oldsize, const struct bsdiff_options* opts, struct threadpool* pool,
+                      struct bsdiff_watch* watch, struct bsdiff_index* index, void** rank)
+{
+  const struct suffix_sort_engine* engine;
+  void* I;
+  int status;
+
+  if ((unsigned int)opts->suffix_sort >= SUFFIX_SORT_ENGINES)
+    return -1;
+  engine = &suffix_sort_engines[opts->suffix_sort];
+  if ((status = watch_sort_check(watch)) != 0)
+    return status;
+
+  index->width = SA_FITS_32(oldsize) ? sizeof(int32_t) : sizeof(int64_t);
+  if ((I = malloc((oldsize + 1) * index->width)) == NULL)
+    return -1;
+
+  if (index->width == sizeof(int32_t))
+    status = engine->sort32(I, old, oldsize, pool, watch, (int32_t**)rank);
+  else
+    status = engine->sort64(I, old, oldsize, pool, watch, (int64_t**)rank);
+  if (status != 0)
+  {
+    free(I);
+    return status;
   }
 
-  x = V[I[start + len / 2] + h];
-  jj = 0;
-  kk = 0;
-  for (i = start; i < start + len; i++)
+  index->I = I;
+  return 0;
+}
+
+/*
+ * Windowed diff, for when old, its index and new do not all fit in
+ * opts->memory_limit. new is cut into windows of a quarter of the old window
+ * size, and each one is diffed against the part of old that holds most of
+ * its anchors, found with a table of the anchors of old: positions where a
+ * gear hash of the preceding bytes has its top ANCHOR_BITS bits clear, so
+ * that the same content gets anchors at the same places in old and new
+ * whatever its offset. Consecutive windows of new keep the old window, and
+ * its index, as long as it still holds 90% of the anchors found, and a
+ * window of new is halved while its anchors do not fit in one old window.
+ */
+#define ANCHOR_BITS 12 // An anchor every 4 KiB on average
+#define ANCHOR_SPAN 64 // Bytes that the gear hash depends on
+#define WINDOW_MIN (1 << 20)
+#define WINDOW_SPLIT_MIN (1 << 16) // Smallest window of new cut at a jump
+
+struct anchor_table
+{
+  uint64_t gear[256];
+  uint64_t* keys; // 0 when empty
+  int64_t* pos;
+  size_t mask;
+  size_t count;
+};
+
+static int is_anchor(uint64_t h)
+{
+  return (h >> (64 - ANCHOR_BITS)) == 0;
+}
+
+static void anchor_gear(struct anchor_table* t)
+{
+  uint64_t x = 0x9e3779b97f4a7c15ULL;
+  int i;
+
+  // splitmix64, for a fixed table of random values
+  for (i = 0; i < 256; i++)
   {
-    if (V[I[i] + h] < x)
-      jj++;
-    if (V[I[i] + h] == x)
-      kk++;
+    uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    t->gear[i] = z ^ (z >> 31);
   }
-  jj += start;
-  kk += jj;
+}
+
+static int64_t anchor_find(const struct anchor_table* t, uint64_t key)
+{
+  size_t i;
+
+  key |= 1;
+  for (i = key & t->mask; t->keys[i] != 0; i = (i + 1) & t->mask)
+    if (t->keys[i] == key)
+      return t->pos[i];
+
+  return -1;
+}
 
-  i = start;
-  j = 0;
-  k = 0;
-  while (i < jj)
+// Index the anchors of old, the first one of each key
+static int anchor_build(struct anchor_table* t, const uint8_t* old, int64_t oldsize)
+{
+  size_t capacity = 1024, i;
+  uint64_t h = 0, key;
+  int64_t k;
+
+  while (capacity < 2 * (size_t)(oldsize >> ANCHOR_BITS))
+    capacity *= 2;
+  anchor_gear(t);
+  t->mask = capacity - 1;
+  t->count = 0;
+  t->keys = calloc(capacity, sizeof(uint64_t));
+  t->pos = malloc(capacity * sizeof(int64_t));
+  if (t->keys == NULL || t->pos == NULL)
+    return -1;
+
+  for (k = 0; k < oldsize && 4 * t->count < 3 * capacity; k++)
   {
-    if (V[I[i] + h] < x)
+    h = (h << 1) + t->gear[old[k]];
+    if (k + 1 < ANCHOR_SPAN || !is_anchor(h))
+      continue;
+    key = h | 1;
+    for (i = key & t->mask; t->keys[i] != 0 && t->keys[i] != key; i = (i + 1) & t->mask)
+      ;
+    if (t->keys[i] == 0)
     {
+      t->keys[i] = key;
+      t->pos[i] = k;
+      t->count++;
+    }
+  }
+
+  return 0;
+}
+
+static void anchor_free(struct anchor_table* t)
+{
+  free(t->keys);
+  free(t->pos);
+}
+
+static int compare_int64(const void* a, const void* b)
+{
+  const int64_t x = *(const int64_t*)a;
+  const int64_t y = *(const int64_t*)b;
+
+  return (x > y) - (x < y);
+}
+
+/*
+ * Start of the old window of size size that holds most of the anchors of
+ * new[start, end), or current when it holds nearly as many. Returns -1 when
+ * new has no anchors there. *spread tells whether more than 10% of the
+ * anchors are left out.
+ */
+static int64_t window_place(const struct anchor_table* t, int64_t oldsize, const uint8_t* new,
+                            int64_t start, int64_t end, int64_t size, int64_t current, int* spread)
+{
+  int64_t* found;
+  int64_t k, n = 0, best = 0, at = 0, i, j, kept = 0;
+  uint64_t h = 0;
+
+  *spread = 0;
+  if ((found = malloc(((end - start) / ANCHOR_SPAN + 1) * sizeof(int64_t))) == NULL)
+    return current;
+
+  // Warm the hash up on the bytes before start
+  for (k = MAX(start - ANCHOR_SPAN, 0); k < end; k++)
+  {
+    h = (h << 1) + t->gear[new[k]];
+    if (k >= start && k + 1 >= ANCHOR_SPAN && is_anchor(h) && (i = anchor_find(t, h)) >= 0 && n < (end - start) / ANCHOR_SPAN + 1)
+      found[n++] = i;
+  }
+  if (n == 0)
+  {
+    free(found);
+    return -1;
+  }
+
+  qsort(found, n, sizeof(int64_t), compare_int64);
+  for (i = 0, j = 0; j < n; j++)
+  {
+    while (found[j] - found[i] >= size)
       i++;
+    if (j - i + 1 > best)
+    {
+      best = j - i + 1;
+      at = MAX(found[i] - (size - (found[j] - found[i])) / 2, 0);
     }
-    else if (V[I[i] + h] == x)
+    if (current >= 0 && found[j] >= current && found[j] < current + size)
+      kept++;
+  }
+  free(found);
+
+  *spread = (10 * best < 9 * n);
+  if (current >= 0 && 10 * kept >= 9 * best)
+    return current;
+  return MIN(at, oldsize - size);
+}
+
+// Bytes needed per byte of old: old itself, I and the work arrays of the sort
+static int64_t index_cost(const struct bsdiff_options* opts, int64_t width)
+{
+  int64_t arrays = (opts->suffix_sort == BSDIFF_SUFSORT_SAIS) ? 1 : (opts->threads > 1) ? 3 : 2;
+
+  if (opts->rank)
+    arrays++;
+  return 1 + arrays * width + (opts->suffix_sort == BSDIFF_SUFSORT_SAIS);
+}
+
+// Size of the old windows, or 0 when the whole diff fits in memory_limit
+static int64_t window_size(int64_t oldsize, int64_t newsize, const struct bsdiff_options* opts)
+{
+  const int64_t limit = (int64_t)MIN(opts->memory_limit, (size_t)INT64_MAX);
+  int64_t budget, size;
+
+  if (limit == 0 || oldsize <= WINDOW_MIN ||
+      oldsize <= (limit - newsize) / index_cost(opts, SA_FITS_32(oldsize) ? 4 : 8))
+    return 0;
+
+  // The anchor table, the prefix buckets and the writers come first, then
+  // each byte of the old window needs a quarter byte of new
+  budget = limit - 4 * (int64_t)sizeof(uint64_t) * (oldsize >> ANCHOR_BITS) - 2 * PREFIX_BUCKETS * sizeof(int64_t) - 4 * WRITE_BUFFER_SIZE;
+  size = MAX(4 * budget / (4 * index_cost(opts, 4) + 1), WINDOW_MIN);
+  size = MIN(size, INT32_MAX - 1);
+
+  return (size < oldsize) ? size : 0;
+}
+
+// Drop the whole pages of [p, p + size) from a read-only file mapping, they
+// are read back from the file if used again
+static void drop_pages(const uint8_t* p, int64_t size)
+{
+#if defined(MADV_DONTNEED)
+  const uintptr_t page = sysconf(_SC_PAGESIZE);
+  const uintptr_t begin = ((uintptr_t)p + page - 1) & ~(page - 1);
+  const uintptr_t end = ((uintptr_t)p + size) & ~(page - 1);
+
+  if (end > begin)
+    madvise((void*)begin, end - begin, MADV_DONTNEED);
+#else
+  (void)p;
+  (void)size;
+#endif
+}
+
+// Records of a window, moved to the whole of old and new, the last one held
+// until the first record of the next window tells where it leads
+struct window_scan
+{
+  bsdiff_emit emit;
+  void* ctx;
+  int64_t newbase;
+  int64_t oldbase;
+  struct bsdiff_ctrl last;
+  int held;
+  int first;
+};
+
+static int window_ctrl(void* ctx, const struct bsdiff_ctrl* ctrl)
+{
+  struct window_scan* ws = ctx;
+
+  if (ws->held)
+  {
+    if (ws->first)
+      ws->last.nextpos = ctrl->oldpos + ws->oldbase;
+    if (ws->emit(ws->ctx, &ws->last))
+      return -1;
+  }
+
+  ws->last = *ctrl;
+  ws->last.newpos += ws->newbase;
+  ws->last.oldpos += ws->oldbase;
+  ws->last.nextpos += ws->oldbase;
+  ws->held = 1;
+  ws->first = 0;
+
+  return 0;
+}
+
+static int scan_windowed(const struct bsdiff_request* req, bsdiff_emit emit, void* ctx)
+{
+  struct bsdiff_request win = *req;
+  struct bsdiff_index index = { 0, NULL };
+  struct hash_index hash = { NULL, NULL, 0 };
+  struct anchor_table anchors;
+  struct window_scan ws;
+  const int64_t size = req->window;
+  const int64_t step = MAX(size / 4, 1);
+  int64_t start, end, at, lastpos;
+  int64_t current = -1;
+  int spread;
+  int status;
+  int result = -1;
+
+  win.buckets = NULL;
+  win.R32 = NULL;
+  win.R64 = NULL;
+  ws.emit = emit;
+  ws.ctx = ctx;
+  ws.held = 0;
+  if (anchor_build(&anchors, req->old, req->oldsize))
+    goto done;
+
+  // Only the current windows of old and new stay in memory when they are
+  // mapped, the records held across windows read the rest back
+  if (req->opts->mapped)
+    drop_pages(req->old, req->oldsize);
+
+  for (start = 0; start < req->newsize; start = end)
+  {
+    end = MIN(start + step, req->newsize);
+
+    // Narrow the window of new down to where its content moves to another
+    // part of old. Without anchors, stay where old was, or follow new
+    // proportionally.
+    while ((at = window_place(&anchors, req->oldsize, req->new, start, end, size, current, &spread)) >= 0 && spread &&
+           end - start > WINDOW_SPLIT_MIN)
+      end = start + (end - start) / 2;
+    if (at < 0 && current >= 0)
+      at = current;
+    else if (at < 0)
+      at = MIN(MAX((int64_t)((double)start * req->oldsize / req->newsize) - size / 2, 0), req->oldsize - size);
+
+    // Past the sort deadline, the windows are hashed instead
+    if (at != current)
     {
-      tmp = I[i];
-      I[i] = I[jj + j];
-      I[jj + j] = tmp;
-      j++;
+      if (current >= 0 && req->opts->mapped)
+        drop_pages(req->old + current, size);
+      bsdiff_index_free(&index);
+      hash_free(&hash);
+      free((void*)win.buckets);
+      win.buckets = NULL;
+      win.hash = NULL;
+      if ((status = sort_index(req->old + at, size, req->opts, req->pool, req->watch, &index, NULL)) < 0)
+        goto done;
+      if (status > 0 && hash_build(&hash, req->old + at, size))
+        goto done;
+      win.hash = (status > 0) ? &hash : NULL;
+      win.buckets = (status > 0) ? NULL : build_buckets(req->old + at, size);
+      win.I32 = (index.width == sizeof(int32_t)) ? index.I : NULL;
+      win.I64 = (index.width == sizeof(int64_t)) ? index.I : NULL;
+      current = at;
     }
-    else
+
+    // Matches may run into the next windows of new
+    win.old = req->old + at;
+    win.oldsize = size;
+    win.new = req->new + start;
+    win.newsize = req->newsize - start;
+    lastpos = search_start(&win, win.new, win.newsize);
+
+    // bspatch starts at old[0], an empty record leads to the first window
+    if (start == 0 && at == 0)
+      lastpos = 0;
+    else if (start == 0)
     {
-      tmp = I[i];
-      I[i] = I[kk + k];
-      I[kk + k] = tmp;
-      k++;
+      memset(&ws.last, 0, sizeof(ws.last));
+      ws.held = 1;
     }
+
+    ws.newbase = start;
+    ws.oldbase = at;
+    ws.first = 1;
+    if (scan_range(&win, 0, end - start, lastpos, window_ctrl, &ws))
+      goto done;
+    if (req->opts->mapped)
+      drop_pages(req->new + start, end - start);
   }
 
-  while (jj + j < kk)
+  result = (ws.held && emit(ctx, &ws.last)) ? -1 : 0;
+
+done:
+  bsdiff_index_free(&index);
+  hash_free(&hash);
+  free((void*)win.buckets);
+  anchor_free(&anchors);
+
+  return result;
+}
+
+// Hand all control records to emit(), in order
+static int bsdiff_internal(const struct bsdiff_request* req, bsdiff_emit emit, void* ctx)
+{
+  int64_t segments = 1;
+
+  if (req->window > 0)
+    return scan_windowed(req, emit, ctx);
+
+  if (req->pool != NULL)
+    segments = MIN(threadpool_threads(req->pool) * SCAN_SEGMENTS_PER_THREAD, req->newsize / SCAN_SEGMENT_MIN);
+
+  if (segments > 1)
+    return scan_parallel(req, segments, emit, ctx);
+
+  /* Compute the differences, writing ctrl as we go */
+  return scan_range(req, 0, req->newsize, 0, emit, ctx);
+}
+
+/*
+ * Streaming scan, with new read through a bsdiff_input into a window of
+ * STREAM_SEGMENT + STREAM_LOOKAHEAD bytes. Each segment is scanned on its
+ * own like in scan_parallel(), with the lookahead letting matches run past
+ * its end. The next segment starts where the last record of the previous one
+ * leaves old, as if its extra data had been diff data, which is where a
+ * single scan would have looked first too.
+ */
+#define STREAM_SEGMENT (8 << 20)
+#define STREAM_LOOKAHEAD (8 << 20)
+
+struct stream_scan
+{
+  const struct bsdiff_request* req; // Over the window
+  struct bsdiff_ctrl last;
+  int held;
+};
+
+// Hold back each record until the next one, so that the last record of a
+// segment can be pointed at the next segment
+static int hold_ctrl(void* ctx, const struct bsdiff_ctrl* ctrl)
+{
+  struct stream_scan* scan = ctx;
+
+  if (scan->held && write_ctrl((void*)scan->req, &scan->last))
+    return -1;
+  scan->last = *ctrl;
+  scan->held = 1;
+
+  return 0;
+}
+
+// Read up to length bytes of new, fewer only at its end
+static int64_t input_fill(struct bsdiff_input* input, uint8_t* buffer, int64_t length)
+{
+  int64_t got = 0;
+  int n;
+
+  while (got < length)
+  {
+    if ((n = input->read(input, buffer + got, (int)MIN(length - got, INT_MAX))) < 0)
+      return -1;
+    if (n == 0)
+      break;
+    got += n;
+  }
+
+  return got;
+}
+
+static int bsdiff_stream_internal(const struct bsdiff_request* req, struct bsdiff_input* input, int64_t* newsize)
+{
+  const int64_t capacity = STREAM_SEGMENT + STREAM_LOOKAHEAD;
+  struct bsdiff_request window = *req;
+  struct stream_scan scan;
+  uint8_t* buffer;
+  int64_t have, length, lastpos, n;
+  int eof = 0;
+  int result = -1;
+
+  if ((buffer = malloc(capacity)) == NULL)
+    return -1;
+
+  scan.req = &window;
+  scan.held = 0;
+  window.new = buffer;
+  have = 0;
+  lastpos = 0;
+  *newsize = 0;
+  for (;;)
   {
-    if (V[I[jj + j] + h] == x)
+    if (!eof)
     {
-      j++;
+      if ((n = input_fill(input, buffer + have, capacity - have)) < 0)
+        goto done;
+      eof = (have + n < capacity);
+      have += n;
     }
-    else
+    if (have == 0)
+      break;
+
+    length = MIN(have, STREAM_SEGMENT);
+    window.newsize = have;
+    if (scan_range(&window, 0, length, lastpos, hold_ctrl, &scan))
+      goto done;
+
+    // Every segment holds at least one record, write the last one before
+    // its data leaves the window
+    if (!eof || length < have)
+      scan.last.nextpos = MIN(scan.last.oldpos + scan.last.difflen + scan.last.extralen, req->oldsize);
+    if (write_ctrl(&window, &scan.last))
+      goto done;
+    scan.held = 0;
+    lastpos = scan.last.nextpos;
+
+    memmove(buffer, buffer + length, have - length);
+    have -= length;
+    *newsize += length;
+  }
+  result = 0;
+
+done:
+  free(buffer);
+  return result;
+}
+
+/*
+ * In-place patches, applied by bspatch_inplace() to a single buffer that
+ * holds old and receives new. The patch is a list of operations, each one
+ * made of three fields in the same encoding as BSDIFF_CTRL_FIXED records:
+ *   length, position in new, position in old or -1
+ * followed by length bytes of data. An operation with a position in old is
+ * a copy: its data is added to the old bytes there, like diff data. The
+ * others are literals, written as is. Copies are at most INPLACE_CHUNK
+ * bytes, so that bspatch can build each one in a scratch buffer before
+ * writing it, which makes a copy overlapping itself harmless.
+ *
+ * A copy must run before the copies that overwrite the old bytes it reads.
+ * Copies are sorted accordingly, and cycles are broken by turning the
+ * shortest copy of the cycle into a literal, its bytes taken from new.
+ * Literals read nothing, so they all come last.
+ */
+#define INPLACE_CHUNK (1 << 14)
+
+struct inplace_op
+{
+  int64_t dst;
+  int64_t src; // -1 for literals
+  int64_t len;
+};
+
+struct inplace_read
+{
+  int64_t src;
+  size_t op;
+};
+
+static int compare_reads(const void* a, const void* b)
+{
+  const struct inplace_read* x = a;
+  const struct inplace_read* y = b;
+
+  return (x->src > y->src) - (x->src < y->src);
+}
+
+/*
+ * Graph of the copies, as compressed adjacency lists: the copies that
+ * must run before copy i are pred[predstart[i], predstart[i + 1]), and
+ * the ones that must run after it succ[succstart[i], succstart[i + 1]).
+ */
+struct inplace_graph
+{
+  size_t* predstart;
+  size_t* pred;
+  size_t* succstart;
+  size_t* succ;
+};
+
+static void inplace_graph_free(struct inplace_graph* g)
+{
+  free(g->predstart);
+  free(g->pred);
+  free(g->succstart);
+  free(g->succ);
+}
+
+static int inplace_graph(const struct inplace_op* ops, size_t n, struct inplace_graph* g)
+{
+  struct inplace_read* reads;
+  size_t* fill = NULL;
+  size_t i, j, lo, hi, mid, edges;
+  int pass;
+
+  memset(g, 0, sizeof(*g));
+  if ((reads = malloc((n + 1) * sizeof(*reads))) == NULL)
+    return -1;
+  for (i = 0; i < n; i++)
+  {
+    reads[i].src = ops[i].src;
+    reads[i].op = i;
+  }
+  qsort(reads, n, sizeof(*reads), compare_reads);
+
+  // Count the edges, then record them. Copy j must run before copy i when
+  // i writes where j reads; since copies are at most INPLACE_CHUNK long,
+  // only the reads starting after dst - INPLACE_CHUNK can overlap.
+  if ((g->predstart = calloc(n + 1, sizeof(size_t))) == NULL)
+    goto fail;
+  for (pass = 0; pass < 2; pass++)
+  {
+    edges = 0;
+    for (i = 0; i < n; i++)
     {
-      tmp = I[jj + j];
-      I[jj + j] = I[kk + k];
-      I[kk + k] = tmp;
-      k++;
+      g->predstart[i] = (pass == 0) ? edges : g->predstart[i];
+      lo = 0;
+      hi = n;
+      while (lo < hi)
+      {
+        mid = lo + (hi - lo) / 2;
+        if (reads[mid].src <= ops[i].dst - INPLACE_CHUNK)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+      for (j = lo; j < n && reads[j].src < ops[i].dst + ops[i].len; j++)
+      {
+        if (reads[j].op == i || reads[j].src + ops[reads[j].op].len <= ops[i].dst)
+          continue;
+        if (pass == 1)
+          g->pred[edges] = reads[j].op;
+        edges++;
+      }
     }
+    g->predstart[n] = edges;
+    if (pass == 0 && (g->pred = malloc((edges + 1) * sizeof(size_t))) == NULL)
+      goto fail;
   }
 
-  if (jj > start)
-    split(I, V, start, jj - start, h);
-
-  for (i = 0; i < kk - jj; i++)
-    V[I[jj + i]] = kk - 1;
-  if (jj == kk - 1)
-    I[jj] = -1;
+  // Transpose
+  if ((g->succstart = calloc(n + 1, sizeof(size_t))) == NULL ||
+      (g->succ = malloc((edges + 1) * sizeof(size_t))) == NULL ||
+      (fill = calloc(n + 1, sizeof(size_t))) == NULL)
+    goto fail;
+  for (i = 0; i < edges; i++)
+    g->succstart[g->pred[i] + 1]++;
+  for (i = 0; i < n; i++)
+    g->succstart[i + 1] += g->succstart[i];
+  for (i = 0; i < n; i++)
+    for (j = g->predstart[i]; j < g->predstart[i + 1]; j++)
+      g->succ[g->succstart[g->pred[j]] + fill[g->pred[j]]++] = i;
+
+  free(fill);
+  free(reads);
+  return 0;
 
-  if (start + len > kk)
-    split(I, V, kk, start + len - kk, h);
+fail:
+  free(fill);
+  free(reads);
+  inplace_graph_free(g);
+  return -1;
 }
 
-// QSUFSORT = Faster Suffix Sorting
-static int qsufsort(int64_t* I, const uint8_t* old, int64_t oldsize)
+enum inplace_state
 {
-  int64_t buckets[256] = {0};
-  int64_t i, h, len;
+  INPLACE_WAITING,
+  INPLACE_READY,     // Queued in order
+  INPLACE_LITERAL
+};
 
-  int64_t* V = malloc((oldsize + 1) * sizeof(int64_t));
-  if (V == NULL)
+/*
+ * Topological sort of the copies (Kahn's algorithm), in the order of new
+ * where the graph allows. order receives the copies that remain copies,
+ * the others get src = -1. Returns the length of order, or -1.
+ */
+static int64_t inplace_order(struct inplace_op* ops, size_t n, size_t* order)
+{
+  struct inplace_graph g;
+  size_t* indegree = NULL;
+  size_t* path = NULL;
+  size_t* seen = NULL;
+  uint8_t* state = NULL;
+  size_t head = 0, tail = 0, next = 0, walks = 0;
+  size_t i, k;
+  int64_t result = -1;
+
+  if (inplace_graph(ops, n, &g))
     return -1;
+  if ((indegree = malloc((n + 1) * sizeof(size_t))) == NULL || (path = malloc((n + 1) * sizeof(size_t))) == NULL ||
+      (seen = calloc(n + 1, sizeof(size_t))) == NULL || (state = calloc(n + 1, 1)) == NULL)
+    goto done;
+
+  for (i = 0; i < n; i++)
+  {
+    indegree[i] = g.predstart[i + 1] - g.predstart[i];
+    if (indegree[i] == 0)
+    {
+      state[i] = INPLACE_READY;
+      order[tail++] = i;
+    }
+  }
 
-  // For each future exemple in this function, imagine there are
-  // only 10 possible elements, and not 256 (so buckets has 10 elements)
-  // Imagine also that old is {4, 9, 2, 1, 9, 4, 7, 5} (oldsize = 8)
-
-  // #1: Count the number of occurences of each possible byte 
-  for (i = 0; i < oldsize; i++)
-    buckets[old[i]]++;
-  // Then buckets is after step #1: {0, 1, 1, 0, 2, 1, 0, 1, 0, 2}
-
-  // #2: Add to each element of the array the sum of its predecessors
-  //     It means that:
-  //     - buckets is now sorted
-  //     - its last element is *oldsize*
-  for (i = 1; i < 256; i++)
-    buckets[i] += buckets[i - 1];
-  // Then buckets is after step #2 : {0, 1, 2, 2, 4, 5, 5, 6, 6, 8}
-  // Note that if we take byte '7', buckets[7] = 6, and 6 is precisely
-  // right _after_ the index where the that last element of value 7 should
-  // be put if we sorted *old* (which would give {1, 2, 4, 4, 5, 7, 9, 9})
-
-  // #3: Shift the array one element to the right
-  for (i = 255; i > 0; i--)
-    buckets[i] = buckets[i - 1];
-  buckets[0] = 0;
-  // Now buckets is {0, 0, 1, 2, 2, 4, 5, 5, 6, 6}
-  // The 8 is not exaclty lost as we know it's the same as *oldsize* (see #2)
-  // Now, for byte '7', we get 5, which is the byte where we should
-  // put the elements of value 7 if we sorted *old*
-
-  // #4 Sorting *old* is precisely what we do here, and we store the result in *I*
-  I[0] = oldsize;
-  for (i = 0; i < oldsize; i++)
-  {
-    // There is a +1 here because we want to keep I[0] unchanged.
-    I[buckets[old[i]] + 1] = i;
-    buckets[old[i]]++;
-  }
-  // I = {8, 1, 2, 4, 4, 5, 7, 9, 9}
-  // buckets = {0, 1, 2, 2, 4, 5, 5, 6, 6, 8}, back to step #2 :)
-
-  // #5 Fill V with the amout of occurences of each byte of *old*
-  // and their predecessors (that's a lot of duplication)
-  for (i = 0; i < oldsize; i++)
-    V[i] = buckets[old[i]];
-  V[oldsize] = 0;
-  // After this step, V = {4, 8, 2, 1, 8, 4, 6, 5, 0}
-
-  // #6 For each possible byte, if it appeared only once
-  // in *old*, put (-1) in I at its index.
-  for (i = 1; i < 256; i++)
-  {
-    if (buckets[i] == buckets[i - 1] + 1)
-      I[buckets[i]] = -1;
-  }
-  I[0] = -1;
-  // After this step, I = {-1, -1, -1, 4, 4, -1, -1, 9, 9}
-
-  // #7 
-  for (h = 1; I[0] != -(oldsize + 1); h += h)
+  for (;;)
   {
+    size_t v, len;
+
+    while (head < tail)
+    {
+      v = order[head++];
+      for (k = g.succstart[v]; k < g.succstart[v + 1]; k++)
+        if (state[g.succ[k]] == INPLACE_WAITING && --indegree[g.succ[k]] == 0)
+        {
+          state[g.succ[k]] = INPLACE_READY;
+          order[tail++] = g.succ[k];
+        }
+    }
+
+    // Every copy left waits on another one left: walk back through them
+    // until the walk meets itself, which closes a cycle
+    while (next < n && state[next] != INPLACE_WAITING)
+      next++;
+    if (next == n)
+      break;
+
+    walks++;
     len = 0;
-    // #7.1 
-    for (i = 0; i < oldsize + 1;)
+    v = next;
+    while (seen[v] != walks)
     {
-      if (I[i] < 0)
-      {
-        len += -I[i];
-        i += -I[i];
-      }
-      else
+      seen[v] = walks;
+      path[len++] = v;
+      for (k = g.predstart[v]; state[g.pred[k]] != INPLACE_WAITING; k++)
+        ;
+      v = g.pred[k];
+    }
+
+    // path from v to its end is the cycle: its shortest copy becomes a literal
+    for (k = len; path[k - 1] != v; k--)
+      ;
+    for (i = k - 1; k < len; k++)
+      if (ops[path[k]].len < ops[path[i]].len)
+        i = k;
+    v = path[i];
+
+    state[v] = INPLACE_LITERAL;
+    ops[v].src = -1;
+    for (k = g.succstart[v]; k < g.succstart[v + 1]; k++)
+      if (state[g.succ[k]] == INPLACE_WAITING && --indegree[g.succ[k]] == 0)
       {
-        if (len)
-          I[i - len] = -len;
-        len = V[I[i]] + 1 - i;
-        split(I, V, i, len, h);
-        i += len;
-        len = 0;
+        state[g.succ[k]] = INPLACE_READY;
+        order[tail++] = g.succ[k];
       }
-    }
-    if (len)
-      I[i - len] = -len;
   }
 
-  for (i = 0; i < oldsize + 1; i++)
-    I[V[i]] = i;
-
-  free(V);
+  result = tail;
 
-  return 0;
+done:
+  free(state);
+  free(seen);
+  free(path);
+  free(indegree);
+  inplace_graph_free(&g);
+  return result;
 }
 
-static int64_t matchlen(const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize)
+static int write_op(const struct bsdiff_request* req, const struct inplace_op* op)
 {
-  int64_t i;
+  uint8_t buf[8 * 3];
 
-  for (i = 0; (i < oldsize) && (i < newsize); i++)
-    if (old[i] != new[i])
-      break;
+  offtout(op->len, buf);
+  offtout(op->dst, buf + 8);
+  offtout(op->src, buf + 16);
+  if (writer_write(req->ctrl, buf, sizeof(buf)))
+    return -1;
 
-  return i;
+  if (op->src >= 0)
+    return writer_sub(req->ctrl, req->new + op->dst, req->old + op->src, op->len);
+
+  return writer_write(req->ctrl, req->new + op->dst, op->len);
 }
 
-static int64_t search(const int64_t* I, const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize, int64_t st, int64_t en, int64_t* pos)
+static int bsdiff_inplace_internal(const struct bsdiff_request* req)
 {
-  int64_t x, y;
-
-  if (en - st < 2)
-  {
-    x = matchlen(old + I[st], oldsize - I[st], new, newsize);
-    y = matchlen(old + I[en], oldsize - I[en], new, newsize);
-
-    if (x > y)
+  struct scan_segment records;
+  struct inplace_op* ops = NULL;
+  struct inplace_op extra;
+  size_t* order = NULL;
+  size_t n = 0, i, k;
+  int64_t ordered, off;
+  int result = -1;
+
+  memset(&records, 0, sizeof(records));
+  if (bsdiff_internal(req, append_ctrl, &records))
+    goto done;
+
+  // Cut the diff data into copies
+  for (i = 0; i < records.count; i++)
+    n += (records.ctrl[i].difflen + INPLACE_CHUNK - 1) / INPLACE_CHUNK;
+  if ((ops = malloc((n + 1) * sizeof(*ops))) == NULL || (order = malloc((n + 1) * sizeof(size_t))) == NULL)
+    goto done;
+  for (i = 0, k = 0; i < records.count; i++)
+    for (off = 0; off < records.ctrl[i].difflen; off += INPLACE_CHUNK)
     {
-      *pos = I[st];
-      return x;
-    }
-    else
-    {
-      *pos = I[en];
-      return y;
+      ops[k].dst = records.ctrl[i].newpos + off;
+      ops[k].src = records.ctrl[i].oldpos + off;
+      ops[k].len = MIN(INPLACE_CHUNK, records.ctrl[i].difflen - off);
+      k++;
     }
-  }
 
-  x = st + (en - st) / 2;
-  if (memcmp(old + I[x], new, MIN(oldsize - I[x], newsize)) < 0)
-  {
-    return search(I, old, oldsize, new, newsize, x, en, pos);
-  }
-  else
+  if ((ordered = inplace_order(ops, n, order)) < 0)
+    goto done;
+
+  for (k = 0; k < (size_t)ordered; k++)
+    if (write_op(req, &ops[order[k]]))
+      goto done;
+
+  // Literals: the copies that were given up, then the extra data
+  for (k = 0; k < n; k++)
+    if (ops[k].src < 0 && write_op(req, &ops[k]))
+      goto done;
+  for (i = 0; i < records.count; i++)
   {
-    return search(I, old, oldsize, new, newsize, st, x, pos);
+    extra.dst = records.ctrl[i].newpos + records.ctrl[i].difflen;
+    extra.src = -1;
+    extra.len = records.ctrl[i].extralen;
+    if (extra.len > 0 && write_op(req, &extra))
+      goto done;
   }
+
+  result = 0;
+
+done:
+  free(order);
+  free(ops);
+  free(records.ctrl);
+  return result;
 }
 
-static void toLittleEndian(uint64_t x, uint8_t* buf)
+// The pool of opts, or a new one to destroy afterwards
+static struct threadpool* options_pool(const struct bsdiff_options* opts)
 {
-  for (unsigned int i = 0; i < 8; i++)
-  {
-    buf[i] = x & 0xff;
-    x = x >> 8;
-  }
+  if (opts->pool != NULL)
+    return opts->pool;
+
+  return (opts->threads > 1) ? threadpool_create(opts->threads) : NULL;
 }
 
-static int64_t writedata(BZFILE* bz2, const void* buffer, int64_t length)
+static void options_pool_release(const struct bsdiff_options* opts, struct threadpool* pool)
 {
-  int64_t result = 0;
+  if (pool != opts->pool)
+    threadpool_destroy(pool);
+}
 
-  while (length > 0)
-  {
-    const int smallsize = (int)MIN(length, INT_MAX);
-    const int writeresult = bz2_write(bz2, buffer, smallsize);
-    if (writeresult == -1)
-    {
-      return -1;
-    }
+int bsdiff_index_build(const uint8_t* old, int64_t oldsize, const struct bsdiff_options* opts, struct bsdiff_index* index)
+{
+  struct threadpool* pool = options_pool(opts);
+  struct bsdiff_watch watch;
+  int result;
 
-    result += writeresult;
-    length -= smallsize;
-    buffer = (uint8_t*)buffer + smallsize;
-  }
+  // An index is built to last, it never gives up on time
+  watch_init(&watch, opts, 0);
+  watch.sort_deadline = 0;
+  result = sort_index(old, oldsize, opts, pool, &watch, index, NULL);
+  watch_destroy(&watch);
 
-  return result;
+  options_pool_release(opts, pool);
+  return (result == 0) ? 0 : -1;
 }
 
-struct bsdiff_request
+void bsdiff_index_free(struct bsdiff_index* index)
 {
-  const uint8_t* old;
-  int64_t oldsize;
-  const uint8_t* new;
-  int64_t newsize;
-  BZFILE* bz2;
-  int64_t* I;
-  uint8_t* buffer;
-};
+  free((void*)index->I);
+  index->I = NULL;
+}
 
-static int bsdiff_internal(const struct bsdiff_request req)
+void bsdiff_options_init(struct bsdiff_options* opts)
 {
-  int64_t scan, pos, len;
-  int64_t lastscan, lastpos, lastoffset;
-  int64_t oldscore, scsc;
-  int64_t s, Sf, lenf, Sb, lenb;
-  int64_t overlap, Ss, lens;
-  int64_t i;
-  uint8_t* buffer;
-  uint8_t buf[8 * 3];
+  opts->suffix_sort = BSDIFF_SUFSORT_QSUFSORT;
+  opts->threads = 1;
+  opts->index = NULL;
+  opts->rank = 0;
+  opts->ctrl_format = BSDIFF_CTRL_FIXED;
+  opts->memory_limit = 0;
+  opts->mapped = 0;
+  opts->engine = BSDIFF_ENGINE_SUFFIX;
+  opts->progress = NULL;
+  opts->progress_opaque = NULL;
+  opts->cancel = NULL;
+  opts->time_budget = 0;
+  opts->pool = NULL;
+}
 
-  int64_t *I = req.I;
+int bsdiff(const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize, struct bsdiff_stream* stream)
+{
+  struct bsdiff_options opts;
 
-  int status = qsufsort(I, req.old, req.oldsize);
-  if (status != 0)
-    return -1;
-  
-  buffer = req.buffer;
+  bsdiff_options_init(&opts);
+  return bsdiff_ex(old, oldsize, new, newsize, stream, &opts);
+}
 
-  /* Compute the differences, writing ctrl as we go */
-  scan = 0;
-  len = 0;
-  pos = 0;
-  lastscan = 0;
-  lastpos = 0;
-  lastoffset = 0;
-  while (scan < req.newsize)
+int bsdiff_ex(const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize, struct bsdiff_stream* stream, const struct bsdiff_options* opts)
+{
+  return bsdiff_channels(old, oldsize, new, newsize, stream, stream, stream, opts);
+}
+
+// new is read from input instead when it is not NULL, and its size returned
+// in *newsize
+static int bsdiff_run(const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t* newsize, struct bsdiff_input* input,
+                      struct bsdiff_stream* ctrl, struct bsdiff_stream* diff, struct bsdiff_stream* extra,
+                      const struct bsdiff_options* opts, int inplace)
+{
+  int result = -1;
+  struct bsdiff_request req;
+  struct bsdiff_index built = { 0, NULL };
+  const struct bsdiff_index* index = opts->index;
+  struct hash_index hash = { NULL, NULL, 0 };
+  struct bsdiff_watch watch;
+  void* rank = NULL;
+  struct bsdiff_writer writers[3] = { { ctrl, NULL, 0 }, { diff, NULL, 0 }, { extra, NULL, 0 } };
+  struct ctrl_chunk chunk;
+  int status = 0;
+  int k;
+
+  watch_init(&watch, opts, *newsize);
+  req.watch = &watch;
+
+  // Without a pool (or if it cannot be created) everything runs on this thread
+  req.pool = options_pool(opts);
+  req.buckets = NULL;
+  req.hash = NULL;
+
+  req.ctrl = &writers[0];
+  req.diff = (diff == ctrl) ? req.ctrl : &writers[1];
+  req.extra = (extra == ctrl) ? req.ctrl : (extra == diff) ? req.diff : &writers[2];
+  req.chunk = (opts->ctrl_format == BSDIFF_CTRL_VARINT && !inplace) ? &chunk : NULL;
+  chunk.used = 4;
+  chunk.single = (req.diff == req.ctrl || req.extra == req.ctrl);
+  for (k = 0; k < 3; k++)
+    if ((writers[k].buffer = malloc(WRITE_BUFFER_SIZE)) == NULL)
+      goto done;
+
+  // Over memory_limit, each window of old gets its own index instead. The
+  // hash engine needs no suffix array, its index is small enough anyway.
+  req.window = (index == NULL && input == NULL && opts->engine != BSDIFF_ENGINE_HASH) ? window_size(oldsize, *newsize, opts) : 0;
+  if (req.window > 0 || opts->engine == BSDIFF_ENGINE_HASH)
+    index = &built;
+  else if (index == NULL)
   {
-    oldscore = 0;
+    // Out of time, the hash engine takes over
+    if ((status = sort_index(old, oldsize, opts, req.pool, &watch, &built, opts->rank ? &rank : NULL)) < 0)
+      goto done;
+    index = &built;
+  }
+  else if (index->width != sizeof(int64_t) && (index->width != sizeof(int32_t) || !SA_FITS_32(oldsize)))
+  {
+    goto done;
+  }
 
-    for (scsc = scan += len; scan < req.newsize; scan++)
-    {
-      len = search(I, req.old, req.oldsize, req.new + scan, req.newsize - scan, 0, req.oldsize, &pos);
+  if (opts->engine == BSDIFF_ENGINE_HASH || status > 0)
+  {
+    if (hash_build(&hash, old, oldsize))
+      goto done;
+    req.hash = &hash;
+  }
 
-      for (; scsc < scan + len; scsc++)
-        if ((scsc + lastoffset < req.oldsize) && (req.old[scsc + lastoffset] == req.new[scsc]))
-          oldscore++;
+  req.I32 = (index->width == sizeof(int32_t)) ? index->I : NULL;
+  req.I64 = (index->width == sizeof(int64_t)) ? index->I : NULL;
 
-      if (((len == oldscore) && (len != 0)) || (len > oldscore + 8))
-        break;
+  // qsufsort hands over the ranks it sorted with, a prebuilt index needs
+  // them computed. Without them, every search starts from scratch.
+  if (opts->rank && rank == NULL && index->I != NULL)
+    rank = (req.I32 != NULL) ? (void*)rank32(req.I32, oldsize) : (void*)rank64(req.I64, oldsize);
+  req.R32 = (req.I32 != NULL) ? rank : NULL;
+  req.R64 = (req.I64 != NULL) ? rank : NULL;
 
-      if ((scan + lastoffset < req.oldsize) && (req.old[scan + lastoffset] == req.new[scan]))
-        oldscore--;
-    }
+  // Without the buckets, search() falls back to the whole of I
+  if (req.window == 0 && req.hash == NULL)
+    req.buckets = build_buckets(old, oldsize);
 
-    if ((len != oldscore) || (scan == req.newsize))
-    {
-      s = 0;
-      Sf = 0;
-      lenf = 0;
-      for (i = 0; (lastscan + i < scan) && (lastpos + i < req.oldsize);)
-      {
-        if (req.old[lastpos + i] == req.new[lastscan + i])
-          s++;
-        i++;
-        if (s * 2 - i > Sf * 2 - lenf)
-        {
-          Sf = s;
-          lenf = i;
-        }
-      }
+  req.old = old;
+  req.oldsize = oldsize;
+  req.new = new;
+  req.newsize = *newsize;
+  req.opts = opts;
 
-      lenb = 0;
-      if (scan < req.newsize)
-      {
-        s = 0;
-        Sb = 0;
-        for (i = 1; (scan >= lastscan + i) && (pos >= i); i++)
-        {
-          if (req.old[pos - i] == req.new[scan - i])
-            s++;
-          if (s * 2 - i > Sb * 2 - lenb)
-          {
-            Sb = s;
-            lenb = i;
-          }
-        }
-      }
+  if (inplace)
+    result = bsdiff_inplace_internal(&req);
+  else if (input != NULL)
+    result = bsdiff_stream_internal(&req, input, newsize);
+  else
+    result = bsdiff_internal(&req, write_ctrl, &req);
+
+  // Flush each channel in the order bspatch reads them
+  if (result == 0 && req.chunk != NULL && chunk_flush(&req))
+    result = -1;
+  if (result == 0 && (writer_flush(req.ctrl) || writer_flush(req.diff) || writer_flush(req.extra)))
+    result = -1;
+
+done:
+  for (k = 0; k < 3; k++)
+    free(writers[k].buffer);
+  free(rank);
+  free((void*)req.buckets);
+  bsdiff_index_free(&built);
+  hash_free(&hash);
+  options_pool_release(opts, req.pool);
+  watch_destroy(&watch);
 
-      if (lastscan + lenf > scan - lenb)
-      {
-        overlap = (lastscan + lenf) - (scan - lenb);
-        s = 0;
-        Ss = 0;
-        lens = 0;
-        for (i = 0; i < overlap; i++)
-        {
-          if (req.new[lastscan + lenf - overlap + i] == req.old[lastpos + lenf - overlap + i])
-            s++;
-          if (req.new[scan - lenb + i] == req.old[pos - lenb + i])
-            s--;
-          if (s > Ss)
-          {
-            Ss = s;
-            lens = i + 1;
-          }
-        }
+  return result;
+}
 
-        lenf += lens - overlap;
-        lenb -= lens;
-      }
+int bsdiff_channels(const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize,
+                    struct bsdiff_stream* ctrl, struct bsdiff_stream* diff, struct bsdiff_stream* extra,
+                    const struct bsdiff_options* opts)
+{
+  return bsdiff_run(old, oldsize, new, &newsize, NULL, ctrl, diff, extra, opts, 0);
+}
 
-      toLittleEndian(lenf, buf);
-      toLittleEndian((scan - lenb) - (lastscan + lenf), buf + 8);
-      toLittleEndian((pos - lenb) - (lastpos + lenf), buf + 16);
+int bsdiff_streaming(const uint8_t* old, int64_t oldsize, struct bsdiff_input* new,
+                     struct bsdiff_stream* ctrl, struct bsdiff_stream* diff, struct bsdiff_stream* extra,
+                     const struct bsdiff_options* opts, int64_t* newsize)
+{
+  *newsize = 0;
+  return bsdiff_run(old, oldsize, NULL, newsize, new, ctrl, diff, extra, opts, 0);
+}
 
-      /* Write control data */
-      if (writedata(req.bz2, buf, sizeof(buf)))
-        return -1;
+int bsdiff_inplace(const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize, struct bsdiff_stream* stream, const struct bsdiff_options* opts)
+{
+  return bsdiff_run(old, oldsize, new, &newsize, NULL, stream, stream, stream, opts, 1);
+}
 
-      /* Write diff data */
-      for (i = 0; i < lenf; i++)
-        buffer[i] = req.new[lastscan + i] - req.old[lastpos + i];
-      if (writedata(req.bz2, buffer, lenf))
-        return -1;
+static int codec_stream_write(struct bsdiff_stream* stream, const void* buffer, int size)
+{
+  return codec_write(stream->opaque, buffer, size);
+}
 
-      /* Write extra data */
-      for (i = 0; i < (scan - lenb) - (lastscan + lenf); i++)
-        buffer[i] = req.new[lastscan + lenf + i];
-      if (writedata(req.bz2, buffer, (scan - lenb) - (lastscan + lenf)))
-        return -1;
+static int codec_frame_stream_write(struct bsdiff_stream* stream, const void* buffer, int size)
+{
+  return codec_frame_write(stream->opaque, buffer, size);
+}
 
-      lastscan = scan - lenb;
-      lastpos = pos - lenb;
-      lastoffset = pos - scan;
-    }
-  }
+// New is read through bsdiff_streaming() when it is not a regular file,
+// or with --stream
+static int fileRead(struct bsdiff_input* input, void* buffer, int size)
+{
+  ssize_t n;
 
-  return 0;
+  while ((n = read(*(int*)input->opaque, buffer, size)) < 0 && errno == EINTR)
+    ;
+
+  return (int)n;
 }
 
-int bsdiff(const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize, BZFILE* bz2)
+// --progress, rewritten in place on stderr
+static void printProgress(void* opaque, enum bsdiff_stage stage, int64_t done, int64_t total)
 {
-  int result;
-  struct bsdiff_request req;
+  const char* what = (stage == BSDIFF_STAGE_SORT) ? "Sorting" : "Diffing";
 
-  if ((req.I = malloc((oldsize + 1) * sizeof(int64_t))) == NULL)
-    return -1;
+  (void)opaque;
+  if (total > 0)
+    fprintf(stderr, "\r%s: %3d%%    ", what, (int)(100.0 * done / total));
+  else
+    fprintf(stderr, "\r%s: %lld MiB", what, (long long)(done >> 20));
+}
+
+// A size in bytes, with an optional K, M or G suffix
+static size_t parseSize(const char* arg)
+{
+  char* end;
+  unsigned long long size = strtoull(arg, &end, 10);
+  int shift = 0;
 
-  if ((req.buffer = malloc(newsize + 1)) == NULL)
+  switch (*end)
   {
-    free(req.I);
-    return -1;
+  case 'G': case 'g': shift += 10; /* fall through */
+  case 'M': case 'm': shift += 10; /* fall through */
+  case 'K': case 'k': shift += 10; end++; break;
   }
+  if (*end != '\0' || end == arg || size > (SIZE_MAX >> shift))
+    return 0;
 
-  req.old = old;
-  req.oldsize = oldsize;
-  req.new = new;
-  req.newsize = newsize;
-  req.bz2 = bz2;
-
-  result = bsdiff_internal(req);
-
-  free(req.buffer);
-  free(req.I);
-
-  return result;
+  return (size_t)size << shift;
 }
 
-static int bz2_write(BZFILE* bz2, const void* buffer, int size)
+// Under a memory limit, the files are mapped rather than read, so that the
+// pages of the windows already diffed can be dropped (see bsdiff_options)
+static uint8_t* mapFile(const char* path, uint64_t* size)
 {
-  int bz2err;
+  int fd = open(path, O_RDONLY, 0);
+  struct stat sb;
+  uint8_t* map;
 
-  BZ2_bzWrite(&bz2err, bz2, (void*)buffer, size);
-  if (bz2err != BZ_STREAM_END && bz2err != BZ_OK)
-    return -1;
+  if (fd < 0 || fstat(fd, &sb) != 0)
+    err(1, "Could not read %s", path);
+  *size = sb.st_size;
+  map = mmap(NULL, *size + 1, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    err(1, "mmap(%s)", path);
+  close(fd);
 
-  return 0;
+  return map;
 }
 
 uint8_t* loadFile(const char* path, uint64_t* size)
@@ -527,57 +1992,437 @@ uint8_t* loadFile(const char* path, uint64_t* size)
   return content;
 }
 
-FILE* prepareOutput(const char* path, uint64_t newSize)
+/*
+ * Patch file, with each channel compressed on its own:
+ *   "ENDSLEY/BSDIFF45"
+ *   codec id (see codec.h), level and flags, 1 byte each, then 5 zero bytes
+ *   newsize, then the compressed sizes of the control and diff channels
+ *   codec(control records), codec(diff data), codec(extra data)
+ * Sizes take 8 bytes each, in the same encoding as control fields. Control
+ * records are BSDIFF_CTRL_VARINT.
+ * With PATCH_FLAG_FRAMED, each channel is a framed stream (see codec.h),
+ * so that frames can be compressed and decompressed in parallel, and each
+ * frame is tagged with its own codec. With PATCH_FLAG_INPLACE, the control
+ * channel holds a patch written by bsdiff_inplace() and the others are empty.
+ * bspatch also reads the older formats: ENDSLEY/BSDIFF44 is the same with
+ * BSDIFF_CTRL_FIXED records, ENDSLEY/BSDIFF43 has everything interleaved in
+ * a single bzip2 stream.
+ */
+#define PATCH_MAGIC "ENDSLEY/BSDIFF45"
+#define PATCH_HEADER_SIZE (16 + 8 + 3 * 8)
+#define PATCH_FLAG_FRAMED 0x01
+#define PATCH_FLAG_INPLACE 0x02
+
+#define DEFAULT_FRAME_SIZE (4 << 20)
+
+// A channel is compressed to a temporary file until all sizes are known
+struct channel
+{
+  FILE* file;
+  FILE* frameData; // The frames, after the table in file, when framed
+  struct codec_writer* writer;
+  struct codec_frame_writer* frames; // Instead of writer when framed
+  struct bsdiff_stream stream;
+};
+
+static void openChannel(struct channel* channel, int codec, int level, int fastCodec, size_t frameSize, struct threadpool* pool)
+{
+  channel->writer = NULL;
+  channel->frames = NULL;
+  channel->frameData = NULL;
+  if ((channel->file = tmpfile()) == NULL)
+    err(1, "tmpfile");
+
+  if (frameSize > 0)
+  {
+    if ((channel->frameData = tmpfile()) == NULL)
+      err(1, "tmpfile");
+    if ((channel->frames = codec_frame_writer_open(codec, level, fastCodec, frameSize, pool, channel->frameData)) == NULL)
+      errx(1, "Could not start %s compression", codec_info(codec)->name);
+    channel->stream.opaque = channel->frames;
+    channel->stream.write = codec_frame_stream_write;
+    return;
+  }
+
+  if ((channel->writer = codec_writer_open(codec, level, channel->file)) == NULL)
+    errx(1, "Could not start %s compression", codec_info(codec)->name);
+  channel->stream.opaque = channel->writer;
+  channel->stream.write = codec_stream_write;
+}
+
+// Returns the compressed size of the channel
+static uint64_t closeChannel(struct channel* channel)
+{
+  off_t size, frameSize = 0;
+
+  int fail = channel->frames ? codec_frame_writer_close(channel->frames, channel->file) : codec_writer_close(channel->writer);
+
+  if (fail || fflush(channel->file) != 0 || (size = ftello(channel->file)) == -1)
+    errx(1, "Could not compress the patch");
+  if (channel->frameData != NULL && (fflush(channel->frameData) != 0 || (frameSize = ftello(channel->frameData)) == -1))
+    errx(1, "Could not compress the patch");
+
+  rewind(channel->file);
+  if (channel->frameData != NULL)
+    rewind(channel->frameData);
+  return size + frameSize;
+}
+
+static void copyChannelFile(FILE* from, FILE* to, const char* path)
 {
+  uint8_t buf[1 << 16];
+  size_t n;
+
+  while ((n = fread(buf, 1, sizeof(buf), from)) > 0)
+    if (fwrite(buf, 1, n, to) != n)
+      err(1, "Failed to write %s", path);
+  if (ferror(from))
+    err(1, "Failed to read back the patch data");
+  fclose(from);
+}
+
+static void writePatch(const char* path, uint64_t newSize, int codec, int level, int flags, struct channel* channels, int count)
+{
+  uint8_t header[PATCH_HEADER_SIZE] = { 0 };
+  int k;
+
+  memcpy(header, PATCH_MAGIC, 16);
+  header[16] = codec;
+  header[17] = level;
+  header[18] = flags;
+  toLittleEndian(newSize, header + 24);
+  for (k = 0; k < count; k++)
+  {
+    const uint64_t size = closeChannel(&channels[k]);
+    if (k < count - 1)
+      toLittleEndian(size, header + 32 + 8 * k);
+  }
+
   // Create the patch file
   FILE* f = fopen(path, "w");
-  if (f  == NULL)
+  if (f == NULL)
     err(1, "Could not create the output file %s", path);
+  if (fwrite(header, sizeof(header), 1, f) != 1)
+    err(1, "Failed to write header");
 
-  // Write header (signature + newsize)
-  int status = fwrite("ENDSLEY/BSDIFF43", 16, 1, f);
-  if (status == 1)
+  for (k = 0; k < count; k++)
   {
-    // The size of the "new" file must be stored with big endian.
-    uint8_t buf[8];
-    toLittleEndian(newSize, buf);
-    status = fwrite(buf, sizeof(buf), 1, f);
+    copyChannelFile(channels[k].file, f, path);
+    if (channels[k].frameData != NULL)
+      copyChannelFile(channels[k].frameData, f, path);
   }
-  if (status != 1)
-    err(1, "Failed to write header");
 
-  return f;
+  if (fclose(f) != 0)
+    err(1, "Failed to write %s", path);
 }
 
-int main(int argc, char* argv[])
+/*
+ * Suffix array index file, written by --build-index and mapped by --index.
+ * The entries of I are stored in native byte order right after the header,
+ * so that the file can be used in place once mapped.
+ */
+#define INDEX_MAGIC "BSDIFFSA"
+#define INDEX_VERSION 1
+#define INDEX_BYTEORDER 0x01020304
+
+struct index_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t byteorder; // INDEX_BYTEORDER, as written by the host that built the index
+  uint32_t width;     // Size of each entry of I
+  uint32_t reserved;
+  uint64_t oldsize;
+  uint64_t checksum;  // checksum() of the old file
+  uint8_t padding[24];  // Keeps I aligned on 64 bytes
+};
+
+// Cheap 64-bit hash, only meant to catch an index used with the wrong old file
+static uint64_t checksum(const uint8_t* data, uint64_t size)
+{
+  const uint64_t prime = 0x9E3779B97F4A7C15ull;
+  uint64_t h = size * prime;
+  uint64_t i, w;
+
+  for (i = 0; i + 8 <= size; i += 8)
+  {
+    memcpy(&w, data + i, 8);
+    w *= prime;
+    w ^= w >> 29;
+    h = (h ^ w) * prime;
+  }
+  for (; i < size; i++)
+    h = (h ^ data[i]) * prime;
+
+  return h ^ (h >> 32);
+}
+
+void buildIndex(const char* oldPath, const char* indexPath, const struct bsdiff_options* opts)
+{
+  struct index_header header;
+  struct bsdiff_index index;
+  uint64_t oldSize;
+  uint8_t* old = loadFile(oldPath, &oldSize);
+  FILE* f;
+
+  if (bsdiff_index_build(old, oldSize, opts, &index))
+    errx(1, "Failed to sort %s", oldPath);
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+  header.version = INDEX_VERSION;
+  header.byteorder = INDEX_BYTEORDER;
+  header.width = index.width;
+  header.oldsize = oldSize;
+  header.checksum = checksum(old, oldSize);
+
+  if ((f = fopen(indexPath, "w")) == NULL)
+    err(1, "Could not create the index file %s", indexPath);
+  if (fwrite(&header, sizeof(header), 1, f) != 1 || fwrite(index.I, index.width, oldSize + 1, f) != oldSize + 1 || fclose(f) != 0)
+    err(1, "Failed to write %s", indexPath);
+
+  bsdiff_index_free(&index);
+  free(old);
+}
+
+// Map an index built by buildIndex(), after checking that it belongs to old
+void* mapIndex(const char* path, const uint8_t* old, uint64_t oldSize, struct bsdiff_index* index, size_t* mapSize)
+{
+  const struct index_header* header;
+  struct stat sb;
+  void* map;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY, 0)) < 0 || fstat(fd, &sb) != 0)
+    err(1, "Could not open %s", path);
+  *mapSize = sb.st_size;
+  if (*mapSize < sizeof(*header))
+    errx(1, "%s is not a bsdiff index", path);
+  if ((map = mmap(NULL, *mapSize, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    err(1, "Could not map %s", path);
+  close(fd);
+
+  header = map;
+  if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0)
+    errx(1, "%s is not a bsdiff index", path);
+  if (header->version != INDEX_VERSION || header->byteorder != INDEX_BYTEORDER)
+    errx(1, "%s was built by an incompatible version or host", path);
+  if ((header->width != sizeof(int32_t) && header->width != sizeof(int64_t)) || header->oldsize != oldSize || *mapSize != sizeof(*header) + (oldSize + 1) * header->width)
+    errx(1, "%s is corrupt or does not match the old file", path);
+  if (header->checksum != checksum(old, oldSize))
+    errx(1, "%s does not match the old file", path);
+
+  // search() jumps all over I
+  madvise(map, *mapSize, MADV_RANDOM);
+
+  index->width = header->width;
+  index->I = (const uint8_t*)map + sizeof(*header);
+
+  return map;
+}
+
+static void usage(const char* name)
 {
-  if (argc != 4)
-    err(1, "Usage: %s <oldfile> <newfile> <patchfile>\n", argv[0]);
+  errx(1, "Usage: %s [-s qsufsort|sais] [-e suffix|hash] [-j threads] [-r] [-c store|bzip2|zstd|lz4] [-l level] [-F frame-size] [--fast-codec zstd|lz4] [--inplace] [--stream] [--memory-limit size] [--time-budget seconds] [--progress] [--index <indexfile>] <oldfile> <newfile> <patchfile>\n"
+          "       %s [-s qsufsort|sais] [-j threads] --build-index <oldfile> <indexfile>", name, name);
+}
 
-  uint64_t oldSize, newSize;
-  uint8_t *old = loadFile(argv[1], &oldSize);
-  uint8_t *new = loadFile(argv[2], &newSize);
+int main(int argc, char* argv[])
+{
+  static const struct option longopts[] =
+  {
+    { "build-index", no_argument, NULL, 'B' },
+    { "index", required_argument, NULL, 'I' },
+    { "rank", no_argument, NULL, 'r' },
+    { "codec", required_argument, NULL, 'c' },
+    { "level", required_argument, NULL, 'l' },
+    { "frame-size", required_argument, NULL, 'F' },
+    { "fast-codec", required_argument, NULL, 'f' },
+    { "inplace", no_argument, NULL, 'P' },
+    { "stream", no_argument, NULL, 'S' },
+    { "memory-limit", required_argument, NULL, 'M' },
+    { "engine", required_argument, NULL, 'e' },
+    { "time-budget", required_argument, NULL, 'T' },
+    { "progress", no_argument, NULL, 'p' },
+    { NULL, 0, NULL, 0 }
+  };
+  struct bsdiff_options opts;
+  struct bsdiff_index index;
+  const char* indexPath = NULL;
+  int buildIndexOnly = 0;
+  int codec = CODEC_BZIP2;
+  int level = -1;
+  int fastCodec = -1;
+  int inplace = 0;
+  int stream = 0;
+  long long frameSize = DEFAULT_FRAME_SIZE;
+  int opt;
+
+  bsdiff_options_init(&opts);
+  opts.ctrl_format = BSDIFF_CTRL_VARINT;
+  while ((opt = getopt_long(argc, argv, "s:e:j:rc:l:F:", longopts, NULL)) != -1)
+  {
+    switch (opt)
+    {
+    case 'B':
+      buildIndexOnly = 1;
+      break;
+    case 'I':
+      indexPath = optarg;
+      break;
+    case 's':
+      {
+        unsigned int i;
+        for (i = 0; i < SUFFIX_SORT_ENGINES; i++)
+          if (strcmp(optarg, suffix_sort_engines[i].name) == 0)
+            break;
+        if (i == SUFFIX_SORT_ENGINES)
+          errx(1, "Unknown suffix sort: %s", optarg);
+        opts.suffix_sort = i;
+      }
+      break;
+    case 'e':
+      if (strcmp(optarg, "suffix") == 0)
+        opts.engine = BSDIFF_ENGINE_SUFFIX;
+      else if (strcmp(optarg, "hash") == 0)
+        opts.engine = BSDIFF_ENGINE_HASH;
+      else
+        errx(1, "Unknown engine: %s", optarg);
+      break;
+    case 'j':
+      opts.threads = atoi(optarg);
+      if (opts.threads < 1)
+        errx(1, "Invalid thread count: %s", optarg);
+      break;
+    case 'r':
+      opts.rank = 1;
+      break;
+    case 'c':
+      if ((codec = codec_find(optarg)) < 0)
+        errx(1, "Unknown codec: %s", optarg);
+      if (!codec_info(codec)->available)
+        errx(1, "This bsdiff was built without %s", optarg);
+      break;
+    case 'l':
+      level = atoi(optarg);
+      break;
+    case 'f':
+      if ((fastCodec = codec_find(optarg)) < 0)
+        errx(1, "Unknown codec: %s", optarg);
+      if (!codec_info(fastCodec)->available)
+        errx(1, "This bsdiff was built without %s", optarg);
+      break;
+    case 'P':
+      inplace = 1;
+      break;
+    case 'S':
+      stream = 1;
+      break;
+    case 'M':
+      if ((opts.memory_limit = parseSize(optarg)) == 0)
+        errx(1, "Invalid memory limit: %s", optarg);
+      break;
+    case 'T':
+      if ((opts.time_budget = atof(optarg)) <= 0)
+        errx(1, "Invalid time budget: %s", optarg);
+      break;
+    case 'p':
+      opts.progress = printProgress;
+      break;
+    case 'F':
+      frameSize = atoll(optarg);
+      if (frameSize < 0 || (unsigned long long)frameSize > SIZE_MAX)
+        errx(1, "Invalid frame size: %s", optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (buildIndexOnly)
+  {
+    if (argc - optind != 2 || indexPath != NULL)
+      usage(argv[0]);
+    buildIndex(argv[optind], argv[optind + 1], &opts);
+    return 0;
+  }
+  if (argc - optind != 3)
+    usage(argv[0]);
+  argv += optind - 1;
+
+  if (level == -1)
+    level = codec_info(codec)->default_level;
+  if (level < codec_info(codec)->min_level || level > codec_info(codec)->max_level)
+    errx(1, "%s levels go from %d to %d", codec_info(codec)->name, codec_info(codec)->min_level, codec_info(codec)->max_level);
+
+  struct stat sb;
+  if (stat(argv[2], &sb) == 0 && !S_ISREG(sb.st_mode))
+    stream = 1;
+  if (stream && inplace)
+    errx(1, "--inplace needs all of %s in memory", argv[2]);
+
+  uint64_t oldSize, newSize = 0;
+  uint8_t *old = opts.memory_limit ? mapFile(argv[1], &oldSize) : loadFile(argv[1], &oldSize);
+  uint8_t *new = stream ? NULL : opts.memory_limit ? mapFile(argv[2], &newSize) : loadFile(argv[2], &newSize);
+  opts.mapped = (opts.memory_limit != 0);
+
+  void* indexMap = NULL;
+  size_t indexMapSize = 0;
+  if (indexPath != NULL)
+  {
+    indexMap = mapIndex(indexPath, old, oldSize, &index, &indexMapSize);
+    opts.index = &index;
+  }
 
-  FILE *outFile = prepareOutput(argv[3], newSize);
+  // Frames are compressed while the diff is running, by the same threads
+  struct threadpool* pool = NULL;
+  if (opts.threads > 1 && (pool = threadpool_create(opts.threads)) == NULL)
+    err(1, "threadpool_create");
+  opts.pool = pool;
 
-  int bz2err;
-  BZFILE* bz2 = BZ2_bzWriteOpen(&bz2err, outFile, 9, 0, 0);
-  if (bz2 == NULL)
-    errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
+  struct channel channels[3];
+  for (int k = 0; k < 3; k++)
+    openChannel(&channels[k], codec, level, fastCodec, frameSize, pool);
 
-  int fail = bsdiff(old, oldSize, new, newSize, bz2);
+  int fail;
+  if (inplace)
+    fail = bsdiff_inplace(old, oldSize, new, newSize, &channels[0].stream, &opts);
+  else if (stream)
+  {
+    int fd = open(argv[2], O_RDONLY, 0);
+    struct bsdiff_input input = { &fd, fileRead };
+    int64_t size;
+
+    if (fd < 0)
+      err(1, "%s", argv[2]);
+    fail = bsdiff_streaming(old, oldSize, &input, &channels[0].stream, &channels[1].stream, &channels[2].stream, &opts, &size);
+    newSize = size;
+    close(fd);
+  }
+  else
+    fail = bsdiff_channels(old, oldSize, new, newSize, &channels[0].stream, &channels[1].stream, &channels[2].stream, &opts);
+  if (opts.progress != NULL)
+    fputc('\n', stderr);
   if (fail)
     err(1, "bsdiff");
 
-  BZ2_bzWriteClose(&bz2err, bz2, 0, NULL, NULL);
-  if (bz2err != BZ_OK)
-    err(1, "BZ2_bzWriteClose, bz2err=%d", bz2err);
-
-  fclose(outFile);
+  int flags = (frameSize > 0 ? PATCH_FLAG_FRAMED : 0) | (inplace ? PATCH_FLAG_INPLACE : 0);
+  writePatch(argv[3], newSize, codec, level, flags, channels, 3);
+  threadpool_destroy(pool);
 
   /* Free the memory we used */
-  free(old);
-  free(new);
+  if (indexMap != NULL)
+    munmap(indexMap, indexMapSize);
+  if (opts.memory_limit)
+  {
+    munmap(old, oldSize + 1);
+    if (new != NULL)
+      munmap(new, newSize + 1);
+  }
+  else
+  {
+    free(old);
+    free(new);
+  }
 
   return 0;
 }
@@ -30,8 +30,112 @@
 
 # include <stddef.h>
 # include <stdint.h>
-# include <bzlib.h>
 
-int bsdiff(const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize, BZFILE* bz2);
+/* Where bsdiff writes patch data. write() returns 0 on success, and is
+ * only ever called with large blocks, except for the last one. */
+struct bsdiff_stream
+{
+  void* opaque;
+  int (*write)(struct bsdiff_stream* stream, const void* buffer, int size);
+};
+
+/* Where bsdiff_streaming() reads new from. read() fills buffer with up to
+ * size bytes of new, in order, and returns how many, 0 at the end of new and
+ * -1 on failure. */
+struct bsdiff_input
+{
+  void* opaque;
+  int (*read)(struct bsdiff_input* input, void* buffer, int size);
+};
+
+/* Suffix array construction used to index the old file */
+enum bsdiff_suffix_sort
+{
+  BSDIFF_SUFSORT_QSUFSORT = 0, /* Larsson-Sadakane prefix doubling, O(n log n) */
+  BSDIFF_SUFSORT_SAIS          /* Induced sorting, O(n) */
+};
+
+/* How matches between old and new are found */
+enum bsdiff_engine
+{
+  BSDIFF_ENGINE_SUFFIX = 0, /* Suffix array of old, smallest patches */
+  BSDIFF_ENGINE_HASH        /* Hashes of old blocks, O(n) with an index of about oldsize / 8 entries, larger patches */
+};
+
+/* What bsdiff is busy with, see bsdiff_options.progress */
+enum bsdiff_stage
+{
+  BSDIFF_STAGE_SORT = 0, /* Sorting the suffixes of old: done out of total are in their final place */
+  BSDIFF_STAGE_SCAN      /* Diffing: done bytes of new out of total, 0 when the size of new is not known yet */
+};
+
+/* Encoding of control records, bspatch must be told which one was used */
+enum bsdiff_ctrl_format
+{
+  BSDIFF_CTRL_FIXED = 0, /* Three 8-byte sign-magnitude fields per record */
+  BSDIFF_CTRL_VARINT     /* Chunks of varint records, much smaller */
+};
+
+struct threadpool;
+
+/* Suffix array of an old file. It only depends on the old file, so it can be
+ * built once with bsdiff_index_build() and shared by many bsdiff_ex() calls. */
+struct bsdiff_index
+{
+  int width;     /* Size of each entry: 4 or 8 bytes */
+  const void* I; /* oldsize + 1 entries, the first one being the empty suffix */
+};
+
+struct bsdiff_options
+{
+  enum bsdiff_suffix_sort suffix_sort;
+  int threads; /* Worker threads for qsufsort, which then needs one more index array */
+  const struct bsdiff_index* index; /* Prebuilt suffix array of old, skips sorting */
+  int rank; /* Keep the inverse suffix array to search next to the previous match, one more index array */
+  enum bsdiff_ctrl_format ctrl_format;
+  size_t memory_limit; /* When old, its index and new need more bytes, diff old in windows, 0 for no limit */
+  int mapped; /* old and new are read-only file mappings, whose pages can be dropped once diffed in windows */
+  enum bsdiff_engine engine; /* suffix_sort, index, rank and memory_limit only apply to BSDIFF_ENGINE_SUFFIX */
+  /* Called after each round of qsufsort and every 64 KiB of new, one call at a time but from any thread, may be NULL */
+  void (*progress)(void* opaque, enum bsdiff_stage stage, int64_t done, int64_t total);
+  void* progress_opaque;
+  const volatile int* cancel; /* Fail as soon as *cancel is non-zero, may be NULL */
+  double time_budget; /* Seconds to finish in, the sort and the scan cutting corners, 0 for no limit */
+  struct threadpool* pool; /* Run on this pool (see threadpool.h) instead of creating one of threads threads, may be NULL */
+};
+
+/* Fill opts with the default settings, used by bsdiff() */
+void bsdiff_options_init(struct bsdiff_options* opts);
+
+/* Sort the suffixes of old with the engine and threads of opts. On success,
+ * index->I is allocated and must be released with bsdiff_index_free(). */
+int bsdiff_index_build(const uint8_t* old, int64_t oldsize, const struct bsdiff_options* opts, struct bsdiff_index* index);
+void bsdiff_index_free(struct bsdiff_index* index);
+
+/* Write the patch to a single stream, control records interleaved with
+ * their diff and extra data, as read by bspatch(). */
+int bsdiff(const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize, struct bsdiff_stream* stream);
+int bsdiff_ex(const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize, struct bsdiff_stream* stream, const struct bsdiff_options* opts);
+
+/* Write control records, diff data and extra data to their own stream each,
+ * as read by bspatch_channels(). They compress very differently: diff data
+ * is mostly zeros, extra data is like new, control records are neither.
+ * Streams passed more than once get their data interleaved. */
+int bsdiff_channels(const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize,
+                    struct bsdiff_stream* ctrl, struct bsdiff_stream* diff, struct bsdiff_stream* extra,
+                    const struct bsdiff_options* opts);
+
+/* Same as bsdiff_channels(), but read new through input, 16 MiB at a time,
+ * and return its size in *newsize. The scan runs on a single thread, and
+ * cannot extend matches across the 8 MiB segments new is cut into, so the
+ * patch is a little larger. */
+int bsdiff_streaming(const uint8_t* old, int64_t oldsize, struct bsdiff_input* new,
+                     struct bsdiff_stream* ctrl, struct bsdiff_stream* diff, struct bsdiff_stream* extra,
+                     const struct bsdiff_options* opts, int64_t* newsize);
+
+/* Write a patch that bspatch_inplace() applies over old, in a single buffer
+ * of max(oldsize, newsize) bytes. It is a little larger than the others,
+ * and ctrl_format is ignored. */
+int bsdiff_inplace(const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize, struct bsdiff_stream* stream, const struct bsdiff_options* opts);
 
 #endif
@@ -0,0 +1,1363 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Suffix array construction and search, written once for every width of
+ * the index. This file has no include guard on purpose: bsdiff.c includes
+ * it once per index type, after defining
+ *  - saidx_t     : the integer type of I (and V)
+ *  - SA_FN(name) : a macro giving each function a width-specific name
+ *
+ * Every index stored in I is at most oldsize + 1, so 32-bit indexes are
+ * enough as long as oldsize < INT32_MAX, halving the memory of I and V.
+ */
+
+#if !defined(saidx_t) || !defined(SA_FN)
+# error "saidx_t and SA_FN must be defined before including bsdiff_sa.h"
+#endif
+
+#ifndef SA_NINTHER
+# define SA_NINTHER 40
+# define SA_SPLIT_STACK 64
+#endif
+
+static saidx_t SA_FN(median3)(saidx_t a, saidx_t b, saidx_t c)
+{
+  if (a < b)
+    return (b < c) ? b : (a < c) ? c : a;
+  return (a < c) ? a : (b < c) ? c : b;
+}
+
+// Pivot of the group I[start, start + len): the median of 3 keys, or of 3
+// medians of 3 (Tukey's ninther) for larger groups, so that sorted or
+// periodic keys don't make every partition lopsided. The key of I[i] is
+// V[I[i] + h], or V[i] itself when I is NULL (keys snapshot).
+static saidx_t SA_FN(pivot)(const saidx_t* I, const saidx_t* V, saidx_t h, saidx_t start, saidx_t len)
+{
+#define SA_KEY(i) ((I != NULL) ? V[I[i] + h] : V[i])
+  const saidx_t a = start;
+  const saidx_t m = start + len / 2;
+  const saidx_t b = start + len - 1;
+  const saidx_t d = len / 8;
+
+  if (len < SA_NINTHER)
+    return SA_FN(median3)(SA_KEY(a), SA_KEY(m), SA_KEY(b));
+
+  return SA_FN(median3)(SA_FN(median3)(SA_KEY(a), SA_KEY(a + d), SA_KEY(a + 2 * d)),
+                        SA_FN(median3)(SA_KEY(m - d), SA_KEY(m), SA_KEY(m + d)),
+                        SA_FN(median3)(SA_KEY(b - 2 * d), SA_KEY(b - d), SA_KEY(b)));
+#undef SA_KEY
+}
+
+// Every suffix of I[jj, kk) has the same rank: kk - 1
+static void SA_FN(mark_group)(saidx_t* I, saidx_t* V, saidx_t jj, saidx_t kk)
+{
+  saidx_t i;
+
+  for (i = jj; i < kk; i++)
+    V[I[i]] = kk - 1;
+  if (jj == kk - 1)
+    I[jj] = -1;
+}
+
+/*
+ * Splits a group by V[I[i] + h], without recursion: the larger unsorted part
+ * waits on a small stack while the smaller one is split. V is updated in
+ * place, so the ranks of the group must keep the order of its parts:
+ * - with a smaller left part, it is split first, then the equal part, kept
+ *   on the stack as (jj, -(kk - jj)), is ranked, then the right part is split
+ * - with a larger left part, it is ranked with its own end at once, so that
+ *   the equal and right parts can come first
+ * The part split next is at most half of the group each time, and two
+ * entries at most are pushed for it, so the stack never fills up.
+ */
+static void SA_FN(split)(saidx_t* I, saidx_t* V, saidx_t start, saidx_t len, saidx_t h)
+{
+  saidx_t stack[4 * SA_SPLIT_STACK];
+  size_t top = 0;
+  saidx_t i, j, k, x, tmp, jj, kk;
+
+  for (;;)
+  {
+    if (len < 0)
+    {
+      SA_FN(mark_group)(I, V, start, start - len);
+    }
+    else if (len < 16)
+    {
+      for (k = start; k < start + len; k += j)
+      {
+        j = 1;
+        x = V[I[k] + h];
+        for (i = 1; k + i < start + len; i++)
+        {
+          if (V[I[k + i] + h] < x)
+          {
+            x = V[I[k + i] + h];
+            j = 0;
+          }
+          if (V[I[k + i] + h] == x)
+          {
+            tmp = I[k + j];
+            I[k + j] = I[k + i];
+            I[k + i] = tmp;
+            j++;
+          }
+        }
+        SA_FN(mark_group)(I, V, k, k + j);
+      }
+    }
+    else
+    {
+      x = SA_FN(pivot)(I, V, h, start, len);
+      jj = 0;
+      kk = 0;
+      for (i = start; i < start + len; i++)
+      {
+        if (V[I[i] + h] < x)
+          jj++;
+        if (V[I[i] + h] == x)
+          kk++;
+      }
+      jj += start;
+      kk += jj;
+
+      i = start;
+      j = 0;
+      k = 0;
+      while (i < jj)
+      {
+        if (V[I[i] + h] < x)
+        {
+          i++;
+        }
+        else if (V[I[i] + h] == x)
+        {
+          tmp = I[i];
+          I[i] = I[jj + j];
+          I[jj + j] = tmp;
+          j++;
+        }
+        else
+        {
+          tmp = I[i];
+          I[i] = I[kk + k];
+          I[kk + k] = tmp;
+          k++;
+        }
+      }
+
+      while (jj + j < kk)
+      {
+        if (V[I[jj + j] + h] == x)
+        {
+          j++;
+        }
+        else
+        {
+          tmp = I[jj + j];
+          I[jj + j] = I[kk + k];
+          I[kk + k] = tmp;
+          k++;
+        }
+      }
+
+      if (jj - start < start + len - kk)
+      {
+        stack[top++] = kk;
+        stack[top++] = start + len - kk;
+        stack[top++] = jj;
+        stack[top++] = jj - kk;
+        len = jj - start;
+      }
+      else
+      {
+        for (i = start; i < jj; i++)
+          V[I[i]] = jj - 1;
+        SA_FN(mark_group)(I, V, jj, kk);
+        stack[top++] = start;
+        stack[top++] = jj - start;
+        len = start + len - kk;
+        start = kk;
+      }
+      continue;
+    }
+
+    if (top == 0)
+      return;
+    len = stack[--top];
+    start = stack[--top];
+  }
+}
+
+/*
+ * Parallel rounds of qsufsort. In a given round, the unsorted groups are
+ * disjoint ranges of I and split() only writes V for the members of the group
+ * it sorts. However it also reads V[I[i] + h], which may belong to a group
+ * being split at the same time by another thread. Each round therefore takes
+ * a snapshot of these keys in K first (one more index array), then sorts every
+ * group against K.
+ *
+ * Consecutive groups are batched into tasks of about SA_BATCH entries. Groups
+ * larger than SA_PARALLEL_SPLIT are partitioned around their pivot by all the
+ * threads at once, until their pieces are small enough to become tasks.
+ *
+ * Every task checks the watch first, and does nothing once the sort is out
+ * of time, which then leaves I and V half sorted.
+ */
+#ifndef SA_BATCH
+# define SA_BATCH (1 << 16)
+# define SA_PARALLEL_SPLIT (1 << 20)
+#endif
+
+struct SA_FN(psort)
+{
+  saidx_t* I;
+  saidx_t* V;
+  saidx_t* K;
+  saidx_t h;
+  struct bsdiff_watch* watch;
+
+  // Parallel partition of one large group
+  saidx_t start;
+  saidx_t len;
+  saidx_t pivot;
+  saidx_t blocks;
+  saidx_t blocksize;
+  saidx_t* counts;  // Lower, equal and higher counts, then offsets, of each block
+  saidx_t* tmpI;
+  saidx_t* tmpK;
+};
+
+struct SA_FN(ranges)
+{
+  saidx_t* data;
+  size_t size;
+  size_t capacity;
+};
+
+static int SA_FN(ranges_push)(struct SA_FN(ranges)* r, saidx_t start, saidx_t len)
+{
+  if (r->size + 2 > r->capacity)
+  {
+    size_t capacity = r->capacity ? r->capacity * 2 : 64;
+    saidx_t* data = realloc(r->data, capacity * sizeof(saidx_t));
+    if (data == NULL)
+      return -1;
+    r->data = data;
+    r->capacity = capacity;
+  }
+  r->data[r->size++] = start;
+  r->data[r->size++] = len;
+
+  return 0;
+}
+
+#define SA_SWAP_KEYED(a, b) \
+  do { \
+    saidx_t tmp_ = I[a]; I[a] = I[b]; I[b] = tmp_; \
+    tmp_ = K[a]; K[a] = K[b]; K[b] = tmp_; \
+  } while (0)
+
+// Same as split(), with the key of I[i] read from K[i] instead of V[I[i] + h].
+// The keys don't change while ranking, so the parts can be ranked in any
+// order: the larger one waits on the stack, which holds at most log2(len).
+static void SA_FN(split_keyed)(saidx_t* I, saidx_t* K, saidx_t* V, saidx_t start, saidx_t len)
+{
+  saidx_t stack[2 * SA_SPLIT_STACK];
+  size_t top = 0;
+  saidx_t i, j, k, x, jj, kk;
+
+  for (;;)
+  {
+    if (len < 16)
+    {
+      for (k = start; k < start + len; k += j)
+      {
+        j = 1;
+        x = K[k];
+        for (i = 1; k + i < start + len; i++)
+        {
+          if (K[k + i] < x)
+          {
+            x = K[k + i];
+            j = 0;
+          }
+          if (K[k + i] == x)
+          {
+            SA_SWAP_KEYED(k + j, k + i);
+            j++;
+          }
+        }
+        SA_FN(mark_group)(I, V, k, k + j);
+      }
+
+      if (top == 0)
+        return;
+      len = stack[--top];
+      start = stack[--top];
+      continue;
+    }
+
+    x = SA_FN(pivot)(NULL, K, 0, start, len);
+    jj = 0;
+    kk = 0;
+    for (i = start; i < start + len; i++)
+    {
+      if (K[i] < x)
+        jj++;
+      if (K[i] == x)
+        kk++;
+    }
+    jj += start;
+    kk += jj;
+
+    i = start;
+    j = 0;
+    k = 0;
+    while (i < jj)
+    {
+      if (K[i] < x)
+      {
+        i++;
+      }
+      else if (K[i] == x)
+      {
+        SA_SWAP_KEYED(i, jj + j);
+        j++;
+      }
+      else
+      {
+        SA_SWAP_KEYED(i, kk + k);
+        k++;
+      }
+    }
+
+    while (jj + j < kk)
+    {
+      if (K[jj + j] == x)
+      {
+        j++;
+      }
+      else
+      {
+        SA_SWAP_KEYED(jj + j, kk + k);
+        k++;
+      }
+    }
+
+    SA_FN(mark_group)(I, V, jj, kk);
+
+    if (jj - start < start + len - kk)
+    {
+      stack[top++] = kk;
+      stack[top++] = start + len - kk;
+      len = jj - start;
+    }
+    else
+    {
+      stack[top++] = start;
+      stack[top++] = jj - start;
+      len = start + len - kk;
+      start = kk;
+    }
+  }
+}
+
+// Tasks walk I[a, b), which starts and ends on group boundaries, and skip
+// the sorted runs in between.
+static void SA_FN(psort_keys)(void* ctx, int64_t a, int64_t b)
+{
+  const struct SA_FN(psort)* p = ctx;
+  saidx_t i, j, len;
+
+  if (watch_sort_check(p->watch))
+    return;
+  for (i = (saidx_t)a; i < b; i += len)
+  {
+    if (p->I[i] < 0)
+    {
+      len = -p->I[i];
+      continue;
+    }
+    len = p->V[p->I[i]] + 1 - i;
+    for (j = i; j < i + len; j++)
+      p->K[j] = p->V[p->I[j] + p->h];
+  }
+}
+
+static void SA_FN(psort_split)(void* ctx, int64_t a, int64_t b)
+{
+  const struct SA_FN(psort)* p = ctx;
+  saidx_t i, len;
+
+  if (watch_sort_check(p->watch))
+    return;
+  for (i = (saidx_t)a; i < b; i += len)
+  {
+    if (p->I[i] < 0)
+    {
+      len = -p->I[i];
+      continue;
+    }
+    len = p->V[p->I[i]] + 1 - i;
+    SA_FN(split_keyed)(p->I, p->K, p->V, i, len);
+  }
+}
+
+// Key snapshot of a chunk of a single large group
+static void SA_FN(psort_keys_flat)(void* ctx, int64_t a, int64_t b)
+{
+  const struct SA_FN(psort)* p = ctx;
+  saidx_t j;
+
+  if (watch_sort_check(p->watch))
+    return;
+  for (j = (saidx_t)a; j < b; j++)
+    p->K[j] = p->V[p->I[j] + p->h];
+}
+
+static void SA_FN(psort_piece)(void* ctx, int64_t start, int64_t len)
+{
+  const struct SA_FN(psort)* p = ctx;
+
+  if (watch_sort_check(p->watch))
+    return;
+  SA_FN(split_keyed)(p->I, p->K, p->V, (saidx_t)start, (saidx_t)len);
+}
+
+// Ranks a chunk of SA_BATCH entries of I[a, kk)
+static void SA_FN(psort_mark)(void* ctx, int64_t a, int64_t kk)
+{
+  const struct SA_FN(psort)* p = ctx;
+  saidx_t i;
+
+  for (i = (saidx_t)a; i < MIN(a + SA_BATCH, kk); i++)
+    p->V[p->I[i]] = (saidx_t)kk - 1;
+}
+
+static void SA_FN(psort_count)(void* ctx, int64_t block, int64_t unused)
+{
+  const struct SA_FN(psort)* p = ctx;
+  const saidx_t begin = p->start + (saidx_t)block * p->blocksize;
+  const saidx_t end = MIN(begin + p->blocksize, p->start + p->len);
+  saidx_t i, lower = 0, equal = 0;
+
+  (void)unused;
+  for (i = begin; i < end; i++)
+  {
+    if (p->K[i] < p->pivot)
+      lower++;
+    else if (p->K[i] == p->pivot)
+      equal++;
+  }
+
+  p->counts[3 * block] = lower;
+  p->counts[3 * block + 1] = equal;
+  p->counts[3 * block + 2] = (end - begin) - lower - equal;
+}
+
+static void SA_FN(psort_scatter)(void* ctx, int64_t block, int64_t unused)
+{
+  const struct SA_FN(psort)* p = ctx;
+  const saidx_t begin = p->start + (saidx_t)block * p->blocksize;
+  const saidx_t end = MIN(begin + p->blocksize, p->start + p->len);
+  saidx_t i, dst[3];
+
+  (void)unused;
+  dst[0] = p->counts[3 * block];
+  dst[1] = p->counts[3 * block + 1];
+  dst[2] = p->counts[3 * block + 2];
+  for (i = begin; i < end; i++)
+  {
+    const int side = (p->K[i] < p->pivot) ? 0 : (p->K[i] == p->pivot) ? 1 : 2;
+    p->tmpI[dst[side]] = p->I[i];
+    p->tmpK[dst[side]] = p->K[i];
+    dst[side]++;
+  }
+}
+
+static void SA_FN(psort_copy)(void* ctx, int64_t block, int64_t unused)
+{
+  const struct SA_FN(psort)* p = ctx;
+  const saidx_t begin = (saidx_t)block * p->blocksize;
+  const saidx_t end = MIN(begin + p->blocksize, p->len);
+
+  (void)unused;
+  memcpy(p->I + p->start + begin, p->tmpI + begin, (end - begin) * sizeof(saidx_t));
+  memcpy(p->K + p->start + begin, p->tmpK + begin, (end - begin) * sizeof(saidx_t));
+}
+
+// Three-way partition of the group I[start, start + len) by every thread,
+// through tmpI and tmpK. Returns the bounds of the "equal" part in jj and kk.
+static void SA_FN(psort_partition)(struct threadpool* pool, struct SA_FN(psort)* p, saidx_t start, saidx_t len, saidx_t* jj, saidx_t* kk)
+{
+  saidx_t b, sum[3];
+
+  p->start = start;
+  p->len = len;
+  p->pivot = SA_FN(pivot)(NULL, p->K, 0, start, len);
+  p->blocksize = (len + p->blocks - 1) / p->blocks;
+
+  for (b = 0; b < p->blocks; b++)
+    threadpool_submit(pool, SA_FN(psort_count), p, b, 0);
+  threadpool_wait(pool);
+
+  // Turn the counts into the destination of each block in tmpI
+  sum[0] = 0;
+  sum[1] = 0;
+  sum[2] = 0;
+  for (b = 0; b < p->blocks; b++)
+  {
+    int side;
+    for (side = 0; side < 3; side++)
+    {
+      const saidx_t count = p->counts[3 * b + side];
+      p->counts[3 * b + side] = sum[side];
+      sum[side] += count;
+    }
+  }
+  for (b = 0; b < p->blocks; b++)
+  {
+    p->counts[3 * b + 1] += sum[0];
+    p->counts[3 * b + 2] += sum[0] + sum[1];
+  }
+
+  for (b = 0; b < p->blocks; b++)
+    threadpool_submit(pool, SA_FN(psort_scatter), p, b, 0);
+  threadpool_wait(pool);
+  for (b = 0; b < p->blocks; b++)
+    threadpool_submit(pool, SA_FN(psort_copy), p, b, 0);
+  threadpool_wait(pool);
+
+  *jj = start + sum[0];
+  *kk = *jj + sum[1];
+}
+
+static int SA_FN(qsufsort_parallel)(struct threadpool* pool, struct bsdiff_watch* watch, saidx_t* I, saidx_t* V, saidx_t oldsize)
+{
+  struct SA_FN(psort) p;
+  struct SA_FN(ranges) batches = { NULL, 0, 0 };
+  struct SA_FN(ranges) big = { NULL, 0, 0 };
+  saidx_t i, len, batch, largest;
+  int64_t h, sorted;
+  size_t n;
+  int result = -1;
+
+  memset(&p, 0, sizeof(p));
+  p.I = I;
+  p.V = V;
+  p.watch = watch;
+  p.blocks = threadpool_threads(pool);
+  p.K = malloc((oldsize + 1) * sizeof(saidx_t));
+  p.counts = malloc(3 * p.blocks * sizeof(saidx_t));
+  if (p.K == NULL || p.counts == NULL)
+    goto done;
+
+  // h is 64-bit: a 32-bit I may still need the round of h = 2^30, and doubling
+  // it afterwards would overflow. Any h used in a round is below oldsize.
+  for (h = 1; I[0] != -(oldsize + 1); h += h)
+  {
+    p.h = (saidx_t)h;
+    batches.size = 0;
+    big.size = 0;
+    largest = 0;
+
+    // #7.1 Same walk as the serial version, which merges the sorted runs.
+    // Unsorted groups are collected in batches instead of being split.
+    len = 0;
+    batch = -1;
+    sorted = 0;
+    for (i = 0; i < oldsize + 1;)
+    {
+      if (I[i] < 0)
+      {
+        sorted += -I[i];
+        len += -I[i];
+        i += -I[i];
+        continue;
+      }
+
+      if (len)
+        I[i - len] = -len;
+      len = V[I[i]] + 1 - i;
+      if (len >= SA_PARALLEL_SPLIT)
+      {
+        if (batch >= 0 && SA_FN(ranges_push)(&batches, batch, i))
+          goto done;
+        batch = -1;
+        if (SA_FN(ranges_push)(&big, i, len))
+          goto done;
+        largest = MAX(largest, len);
+      }
+      else
+      {
+        if (batch < 0)
+          batch = i;
+        if (i + len - batch >= SA_BATCH)
+        {
+          if (SA_FN(ranges_push)(&batches, batch, i + len))
+            goto done;
+          batch = -1;
+        }
+      }
+      i += len;
+      len = 0;
+    }
+    if (len)
+      I[i - len] = -len;
+    if (batch >= 0 && SA_FN(ranges_push)(&batches, batch, i - len))
+      goto done;
+    // Once everything is sorted, finishing costs nothing
+    if ((result = watch_sort(watch, sorted, oldsize + 1)) != 0 && sorted <= oldsize)
+      goto done;
+    result = -1;
+
+    // #7.2 Snapshot of the keys
+    for (n = 0; n < batches.size && !watch_expired(watch); n += 2)
+      threadpool_submit(pool, SA_FN(psort_keys), &p, batches.data[n], batches.data[n + 1]);
+    for (n = 0; n < big.size && !watch_expired(watch); n += 2)
+      for (i = big.data[n]; i < big.data[n] + big.data[n + 1]; i += SA_BATCH)
+        threadpool_submit(pool, SA_FN(psort_keys_flat), &p, i, MIN(i + SA_BATCH, big.data[n] + big.data[n + 1]));
+    threadpool_wait(pool);
+    if ((result = watch_sort_check(watch)) != 0)
+      goto done;
+    result = -1;
+
+    // #7.3 Split every group
+    for (n = 0; n < batches.size && !watch_expired(watch); n += 2)
+      threadpool_submit(pool, SA_FN(psort_split), &p, batches.data[n], batches.data[n + 1]);
+
+    if (largest > 0)
+    {
+      p.tmpI = malloc(largest * sizeof(saidx_t));
+      p.tmpK = malloc(largest * sizeof(saidx_t));
+    }
+    while (big.size > 0)
+    {
+      const saidx_t start = big.data[big.size - 2];
+      const saidx_t plen = big.data[big.size - 1];
+      saidx_t jj, kk;
+
+      big.size -= 2;
+
+      // Large groups take most of the round, while the tasks run
+      if ((result = watch_sort_check(watch)) != 0)
+        goto done;
+      result = -1;
+
+      if (plen < SA_PARALLEL_SPLIT || p.tmpI == NULL || p.tmpK == NULL)
+      {
+        threadpool_submit(pool, SA_FN(psort_piece), &p, start, plen);
+        continue;
+      }
+
+      SA_FN(psort_partition)(pool, &p, start, plen, &jj, &kk);
+      if (kk - jj > SA_BATCH)
+      {
+        for (i = jj; i < kk; i += SA_BATCH)
+          threadpool_submit(pool, SA_FN(psort_mark), &p, i, kk);
+      }
+      else
+      {
+        SA_FN(mark_group)(I, V, jj, kk);
+      }
+      if (jj > start && SA_FN(ranges_push)(&big, start, jj - start))
+        threadpool_submit(pool, SA_FN(psort_piece), &p, start, jj - start);
+      if (start + plen > kk && SA_FN(ranges_push)(&big, kk, start + plen - kk))
+        threadpool_submit(pool, SA_FN(psort_piece), &p, kk, start + plen - kk);
+    }
+    threadpool_wait(pool);
+    if ((result = watch_sort_check(watch)) != 0)
+      goto done;
+    result = -1;
+
+    free(p.tmpI);
+    free(p.tmpK);
+    p.tmpI = NULL;
+    p.tmpK = NULL;
+  }
+
+  result = 0;
+
+done:
+  // Tasks may still be running if we ran out of memory or time midway
+  threadpool_wait(pool);
+  free(p.tmpI);
+  free(p.tmpK);
+  free(big.data);
+  free(batches.data);
+  free(p.counts);
+  free(p.K);
+  return result;
+}
+
+// Inverse of I: R[I[i]] = i. Returns NULL if it cannot be allocated.
+static saidx_t* SA_FN(rank)(const saidx_t* I, int64_t oldsize)
+{
+  saidx_t* R = malloc((oldsize + 1) * sizeof(saidx_t));
+  int64_t i;
+
+  if (R != NULL)
+  {
+    for (i = 0; i < oldsize + 1; i++)
+      R[I[i]] = (saidx_t)i;
+  }
+
+  return R;
+}
+
+/*
+ * Suffixes inside long runs of a single byte c (padding, zero-filled
+ * sections) take one round per doubling of the longest run, each round
+ * splitting the whole run again. Their order is known up front though. For a
+ * suffix made of exactly k c's followed by a byte d (or the end of old):
+ *  - every suffix with d lower than c (or at the end) sorts before every
+ *    suffix with d higher than c,
+ *  - among the former, the more c's, the higher the suffix,
+ *  - among the latter, the more c's, the lower the suffix.
+ * So rank_runs() lays every bucket out again in 4 parts: the suffixes with
+ * less than SA_RUN_MIN c's and a lower d, the others with a lower d by
+ * increasing k, those with a higher d by decreasing k, and the short ones with
+ * a higher d. Long ones with the same k are ordered by the 8 bytes after their
+ * run, and only those that tie on all of this are left to the rounds.
+ */
+#ifndef SA_RUN_MIN
+# define SA_RUN_MIN 128
+
+struct sa_run
+{
+  int64_t pos;
+  int64_t len;
+  uint64_t next; // Up to 8 bytes after the run, big endian, zero padded
+  int64_t link;  // Next run of the same kind that is still long enough
+  int kind;      // 2 * byte + 1 if followed by a higher byte
+};
+
+static int compare_runs(const void* a, const void* b)
+{
+  const struct sa_run* x = a;
+  const struct sa_run* y = b;
+
+  if (x->kind != y->kind)
+    return (x->kind > y->kind) - (x->kind < y->kind);
+  if (x->next != y->next)
+    return (x->next > y->next) - (x->next < y->next);
+  return (x->pos > y->pos) - (x->pos < y->pos);
+}
+#endif
+
+// Lays out again the buckets of I and V made by qsufsort() as described
+// above. Leaves them as they are if old has no long run, or if the runs
+// cannot be recorded.
+static void SA_FN(rank_runs)(saidx_t* I, saidx_t* V, const uint8_t* old, saidx_t oldsize)
+{
+  saidx_t count[4][256] = {{0}};
+  saidx_t at[4][256];
+  struct sa_run* runs;
+  size_t nruns, first, r;
+  saidx_t i, k, x, jj, m, start, end;
+  int64_t head, q, *prev;
+  int c, part, higher;
+
+  nruns = 0;
+  for (i = 0; i < oldsize; i += k)
+  {
+    for (k = 1; i + k < oldsize && old[i + k] == old[i]; k++)
+      ;
+    if (k >= SA_RUN_MIN)
+      nruns++;
+  }
+  if (nruns == 0 || (runs = malloc(nruns * sizeof(*runs))) == NULL)
+    return;
+
+  // Backwards, k is the number of times old[i] repeats from i, and the
+  // parts of a bucket are: short and lower, long and lower, long and higher,
+  // short and higher
+  nruns = 0;
+  k = 0;
+  higher = 0;
+  for (i = oldsize - 1; i >= 0; i--)
+  {
+    if (i + 1 < oldsize && old[i + 1] == old[i])
+    {
+      k++;
+    }
+    else
+    {
+      k = 1;
+      higher = (i + 1 < oldsize && old[i + 1] > old[i]);
+    }
+    count[(k >= SA_RUN_MIN) ? 1 + higher : 3 * higher][old[i]]++;
+
+    if (k >= SA_RUN_MIN && (i == 0 || old[i - 1] != old[i]))
+    {
+      runs[nruns].pos = i;
+      runs[nruns].len = k;
+      runs[nruns].kind = 2 * old[i] + higher;
+      runs[nruns].next = 0;
+      for (x = i + k; x < i + k + 8; x++)
+        runs[nruns].next = (runs[nruns].next << 8) | ((x < oldsize) ? old[x] : 0);
+      nruns++;
+    }
+  }
+
+  x = 1;
+  for (c = 0; c < 256; c++)
+  {
+    for (part = 0; part < 4; part++)
+    {
+      at[part][c] = x;
+      x += count[part][c];
+    }
+  }
+
+  // Short suffixes, one group per part
+  k = 0;
+  higher = 0;
+  for (i = oldsize - 1; i >= 0; i--)
+  {
+    if (i + 1 < oldsize && old[i + 1] == old[i])
+    {
+      k++;
+    }
+    else
+    {
+      k = 1;
+      higher = (i + 1 < oldsize && old[i + 1] > old[i]);
+    }
+    if (k < SA_RUN_MIN)
+      I[at[3 * higher][old[i]]++] = i;
+  }
+  for (c = 0; c < 256; c++)
+  {
+    if (count[0][c] > 0)
+      SA_FN(mark_group)(I, V, at[0][c] - count[0][c], at[0][c]);
+    if (count[3][c] > 0)
+      SA_FN(mark_group)(I, V, at[3][c] - count[3][c], at[3][c]);
+  }
+
+  // Long suffixes, for each k from SA_RUN_MIN up, of the runs that are at
+  // least k long. Runs followed by a higher byte are laid out from the end.
+  qsort(runs, nruns, sizeof(*runs), compare_runs);
+  for (first = 0; first < nruns; first = r)
+  {
+    for (r = first; r < nruns && runs[r].kind == runs[first].kind; r++)
+      runs[r].link = (r + 1 < nruns && runs[r + 1].kind == runs[first].kind) ? (int64_t)r + 1 : -1;
+    c = runs[first].kind >> 1;
+    higher = runs[first].kind & 1;
+    start = at[1 + higher][c];
+    end = start + count[1 + higher][c];
+
+    head = first;
+    for (k = SA_RUN_MIN; head >= 0; k++)
+    {
+      m = 0;
+      for (prev = &head; (q = *prev) >= 0;)
+      {
+        if (runs[q].len < k)
+        {
+          *prev = runs[q].link;
+          continue;
+        }
+        m++;
+        prev = &runs[q].link;
+      }
+
+      x = higher ? end - m : start;
+      jj = x;
+      for (q = head; q >= 0; q = runs[q].link)
+      {
+        I[x++] = (saidx_t)(runs[q].pos + runs[q].len - k);
+        if (runs[q].link < 0 || runs[runs[q].link].next != runs[q].next)
+        {
+          SA_FN(mark_group)(I, V, jj, x);
+          jj = x;
+        }
+      }
+      if (higher)
+        end -= m;
+      else
+        start += m;
+    }
+  }
+
+  free(runs);
+}
+
+// QSUFSORT = Faster Suffix Sorting
+static int SA_FN(qsufsort)(saidx_t* I, const uint8_t* old, int64_t size, struct threadpool* pool, struct bsdiff_watch* watch, saidx_t** rank)
+{
+  const saidx_t oldsize = (saidx_t)size;
+  saidx_t buckets[256] = {0};
+  saidx_t i, len;
+  int64_t h, sorted;
+  struct watch_stride stride;
+  int status;
+
+  saidx_t* V = malloc((oldsize + 1) * sizeof(saidx_t));
+  if (V == NULL)
+    return -1;
+
+  // For each future exemple in this function, imagine there are
+  // only 10 possible elements, and not 256 (so buckets has 10 elements)
+  // Imagine also that old is {4, 9, 2, 1, 9, 4, 7, 5} (oldsize = 8)
+
+  // #1: Count the number of occurences of each possible byte 
+  for (i = 0; i < oldsize; i++)
+    buckets[old[i]]++;
+  // Then buckets is after step #1: {0, 1, 1, 0, 2, 1, 0, 1, 0, 2}
+
+  // #2: Add to each element of the array the sum of its predecessors
+  //     It means that:
+  //     - buckets is now sorted
+  //     - its last element is *oldsize*
+  for (i = 1; i < 256; i++)
+    buckets[i] += buckets[i - 1];
+  // Then buckets is after step #2 : {0, 1, 2, 2, 4, 5, 5, 6, 6, 8}
+  // Note that if we take byte '7', buckets[7] = 6, and 6 is precisely
+  // right _after_ the index where the that last element of value 7 should
+  // be put if we sorted *old* (which would give {1, 2, 4, 4, 5, 7, 9, 9})
+
+  // #3: Shift the array one element to the right
+  for (i = 255; i > 0; i--)
+    buckets[i] = buckets[i - 1];
+  buckets[0] = 0;
+  // Now buckets is {0, 0, 1, 2, 2, 4, 5, 5, 6, 6}
+  // The 8 is not exaclty lost as we know it's the same as *oldsize* (see #2)
+  // Now, for byte '7', we get 5, which is the byte where we should
+  // put the elements of value 7 if we sorted *old*
+
+  // #4 Sorting *old* is precisely what we do here, and we store the result in *I*
+  I[0] = oldsize;
+  for (i = 0; i < oldsize; i++)
+  {
+    // There is a +1 here because we want to keep I[0] unchanged.
+    I[buckets[old[i]] + 1] = i;
+    buckets[old[i]]++;
+  }
+  // I = {8, 1, 2, 4, 4, 5, 7, 9, 9}
+  // buckets = {0, 1, 2, 2, 4, 5, 5, 6, 6, 8}, back to step #2 :)
+
+  // Each step over a large old takes a while already
+  if ((status = watch_sort_check(watch)) != 0)
+  {
+    free(V);
+    return status;
+  }
+
+  // #5 Fill V with the amout of occurences of each byte of *old*
+  // and their predecessors (that's a lot of duplication)
+  for (i = 0; i < oldsize; i++)
+    V[i] = buckets[old[i]];
+  V[oldsize] = 0;
+  // After this step, V = {4, 8, 2, 1, 8, 4, 6, 5, 0}
+
+  // #6 For each possible byte, if it appeared only once
+  // in *old*, put (-1) in I at its index.
+  for (i = 1; i < 256; i++)
+  {
+    if (buckets[i] == buckets[i - 1] + 1)
+      I[buckets[i]] = -1;
+  }
+  I[0] = -1;
+  // After this step, I = {-1, -1, -1, 4, 4, -1, -1, 9, 9}
+
+  // #6.5 Suffixes inside long runs of a single byte are ranked right away
+  SA_FN(rank_runs)(I, V, old, oldsize);
+  if ((status = watch_sort_check(watch)) != 0)
+  {
+    free(V);
+    return status;
+  }
+
+  // #7 
+  if (pool != NULL && threadpool_threads(pool) > 1 && oldsize >= SA_BATCH)
+  {
+    if ((status = SA_FN(qsufsort_parallel)(pool, watch, I, V, oldsize)) != 0)
+    {
+      free(V);
+      return status;
+    }
+  }
+  else
+  {
+    // 64-bit h, as in qsufsort_parallel()
+    watch_stride_init(&stride);
+    for (h = 1; I[0] != -(oldsize + 1); h += h)
+    {
+      len = 0;
+      sorted = 0;
+      stride.next = stride.stride;
+      // #7.1 
+      for (i = 0; i < oldsize + 1;)
+      {
+        if (I[i] < 0)
+        {
+          sorted += -I[i];
+          len += -I[i];
+          i += -I[i];
+        }
+        else
+        {
+          if (len)
+            I[i - len] = -len;
+          len = V[I[i]] + 1 - i;
+          SA_FN(split)(I, V, i, len, (saidx_t)h);
+          i += len;
+          len = 0;
+        }
+
+        // A round over a large old takes a while
+        if (i >= stride.next && (status = watch_stride(watch, &stride, i)) != 0)
+        {
+          free(V);
+          return status;
+        }
+      }
+      if (len)
+        I[i - len] = -len;
+
+      // Once everything is sorted, finishing costs nothing
+      if ((status = watch_sort(watch, sorted, oldsize + 1)) != 0 && sorted <= oldsize)
+      {
+        free(V);
+        return status;
+      }
+    }
+  }
+
+  // V now holds the rank of each suffix, which is the inverse of I
+  for (i = 0; i < oldsize + 1; i++)
+    I[V[i]] = i;
+
+  if (rank != NULL)
+    *rank = V;
+  else
+    free(V);
+
+  return 0;
+}
+
+/*
+ * SA-IS = Linear Suffix Array Construction by Almost Pure Induced-Sorting
+ * (Nong, Zhang & Chan). It builds exactly the same I as qsufsort, but in
+ * O(n) time and with only a type bitmap and a bucket table on top of I.
+ *
+ * At the top level, the string is *old* followed by a virtual sentinel that
+ * is smaller than any byte, so that I[0] ends up being the empty suffix
+ * (oldsize) just like with qsufsort. Recursion levels work on the names of
+ * the LMS substrings, stored inside I itself.
+ */
+struct SA_FN(sais_string)
+{
+  const uint8_t* bytes; // Top level: *old*, with the sentinel at index n - 1
+  const saidx_t* names; // Recursion levels: reduced string
+  saidx_t n;
+};
+
+static saidx_t SA_FN(sais_chr)(const struct SA_FN(sais_string)* s, saidx_t i)
+{
+  if (s->bytes == NULL)
+    return s->names[i];
+
+  return (i == s->n - 1) ? 0 : (saidx_t)s->bytes[i] + 1;
+}
+
+#ifndef SAIS_TGET
+# define SAIS_TGET(t, i) ((t[(i) >> 3] >> ((i) & 7)) & 1)
+# define SAIS_TSET(t, i, b) (t[(i) >> 3] = (b) ? (t[(i) >> 3] | (1 << ((i) & 7))) : (t[(i) >> 3] & ~(1 << ((i) & 7))))
+# define SAIS_ISLMS(t, i) ((i) > 0 && SAIS_TGET(t, i) && !SAIS_TGET(t, (i) - 1))
+#endif
+
+static void SA_FN(sais_buckets)(const struct SA_FN(sais_string)* s, saidx_t* bkt, saidx_t k, int end)
+{
+  saidx_t i, sum = 0;
+
+  for (i = 0; i < k; i++)
+    bkt[i] = 0;
+  for (i = 0; i < s->n; i++)
+    bkt[SA_FN(sais_chr)(s, i)]++;
+  for (i = 0; i < k; i++)
+  {
+    sum += bkt[i];
+    bkt[i] = end ? sum : sum - bkt[i];
+  }
+}
+
+// Induce the L-type suffixes from the sorted LMS ones, then the S-type
+// suffixes from the L-type ones.
+static void SA_FN(sais_induce)(const struct SA_FN(sais_string)* s, const uint8_t* t, saidx_t* SA, saidx_t* bkt, saidx_t k)
+{
+  saidx_t i, j;
+
+  SA_FN(sais_buckets)(s, bkt, k, 0);
+  for (i = 0; i < s->n; i++)
+  {
+    j = SA[i] - 1;
+    if (j >= 0 && !SAIS_TGET(t, j))
+      SA[bkt[SA_FN(sais_chr)(s, j)]++] = j;
+  }
+
+  SA_FN(sais_buckets)(s, bkt, k, 1);
+  for (i = s->n - 1; i >= 0; i--)
+  {
+    j = SA[i] - 1;
+    if (j >= 0 && SAIS_TGET(t, j))
+      SA[--bkt[SA_FN(sais_chr)(s, j)]] = j;
+  }
+}
+
+// Returns 1 when watch is past its sort deadline, checked after each pass
+static int SA_FN(sais_main)(const struct SA_FN(sais_string)* s, saidx_t* SA, saidx_t k, struct bsdiff_watch* watch)
+{
+  const saidx_t n = s->n;
+  saidx_t i, j, n1, name, prev, pos, d;
+  saidx_t* bkt;
+  uint8_t* t;
+  int result = -1;
+  int status;
+
+  t = calloc(n / 8 + 1, 1);
+  bkt = malloc(k * sizeof(saidx_t));
+  if (t == NULL || bkt == NULL)
+    goto done;
+
+  // #1 Classify each suffix as S-type (1) or L-type (0). The sentinel is S.
+  SAIS_TSET(t, n - 1, 1);
+  for (i = n - 2; i >= 0; i--)
+  {
+    const saidx_t c0 = SA_FN(sais_chr)(s, i);
+    const saidx_t c1 = SA_FN(sais_chr)(s, i + 1);
+    SAIS_TSET(t, i, (c0 < c1) || (c0 == c1 && SAIS_TGET(t, i + 1)));
+  }
+
+  // #2 Sort the LMS substrings with one pass of induced sorting
+  SA_FN(sais_buckets)(s, bkt, k, 1);
+  for (i = 0; i < n; i++)
+    SA[i] = -1;
+  for (i = 1; i < n; i++)
+    if (SAIS_ISLMS(t, i))
+      SA[--bkt[SA_FN(sais_chr)(s, i)]] = i;
+  SA_FN(sais_induce)(s, t, SA, bkt, k);
+  if ((status = watch_sort_check(watch)) != 0)
+  {
+    result = status;
+    goto done;
+  }
+
+  // #3 Compact the sorted LMS substrings at the front of SA and name them.
+  // Two LMS positions are at least 2 apart, so the names fit in SA[n1...]
+  // when indexed by pos / 2.
+  n1 = 0;
+  for (i = 0; i < n; i++)
+    if (SAIS_ISLMS(t, SA[i]))
+      SA[n1++] = SA[i];
+  for (i = n1; i < n; i++)
+    SA[i] = -1;
+
+  name = 0;
+  prev = -1;
+  for (i = 0; i < n1; i++)
+  {
+    int diff = 0;
+    pos = SA[i];
+    for (d = 0; d < n; d++)
+    {
+      if (prev == -1 || SA_FN(sais_chr)(s, pos + d) != SA_FN(sais_chr)(s, prev + d) || SAIS_TGET(t, pos + d) != SAIS_TGET(t, prev + d))
+      {
+        diff = 1;
+        break;
+      }
+      else if (d > 0 && (SAIS_ISLMS(t, pos + d) || SAIS_ISLMS(t, prev + d)))
+      {
+        break;
+      }
+    }
+    if (diff)
+    {
+      name++;
+      prev = pos;
+    }
+    SA[n1 + pos / 2] = name - 1;
+  }
+  for (i = n - 1, j = n - 1; i >= n1; i--)
+    if (SA[i] >= 0)
+      SA[j--] = SA[i];
+
+  // #4 Sort the reduced string, recursively if the names are not unique
+  {
+    saidx_t* s1 = SA + n - n1;
+    if (name < n1)
+    {
+      struct SA_FN(sais_string) reduced = { NULL, s1, n1 };
+      if ((status = SA_FN(sais_main)(&reduced, SA, name, watch)) != 0)
+      {
+        result = status;
+        goto done;
+      }
+    }
+    else
+    {
+      for (i = 0; i < n1; i++)
+        SA[s1[i]] = i;
+    }
+
+    // #5 Map the reduced suffix array back to LMS positions, place them at
+    // the end of their buckets, and induce the whole suffix array.
+    for (i = 1, j = 0; i < n; i++)
+      if (SAIS_ISLMS(t, i))
+        s1[j++] = i;
+    for (i = 0; i < n1; i++)
+      SA[i] = s1[SA[i]];
+  }
+  for (i = n1; i < n; i++)
+    SA[i] = -1;
+  SA_FN(sais_buckets)(s, bkt, k, 1);
+  for (i = n1 - 1; i >= 0; i--)
+  {
+    j = SA[i];
+    SA[i] = -1;
+    SA[--bkt[SA_FN(sais_chr)(s, j)]] = j;
+  }
+  SA_FN(sais_induce)(s, t, SA, bkt, k);
+
+  result = 0;
+
+done:
+  free(bkt);
+  free(t);
+  return result;
+}
+
+static int SA_FN(sais)(saidx_t* I, const uint8_t* old, int64_t oldsize, struct threadpool* pool, struct bsdiff_watch* watch, saidx_t** rank)
+{
+  struct SA_FN(sais_string) s = { old, NULL, oldsize + 1 };
+  int status;
+
+  // Induced sorting is sequential by nature
+  (void)pool;
+  if ((status = watch_sort(watch, 0, oldsize + 1)) != 0)
+    return status;
+
+  if (oldsize == 0)
+    I[0] = 0;
+  // 256 possible bytes plus the sentinel
+  else if ((status = SA_FN(sais_main)(&s, I, 257, watch)) != 0)
+    return status;
+  watch_sort(watch, oldsize + 1, oldsize + 1);
+
+  if (rank != NULL)
+    *rank = SA_FN(rank)(I, oldsize);
+
+  return 0;
+}
+
+// Binary search of new in I[st, en]. Each step only picks one of two bounds,
+// which compiles to conditional moves, and the suffixes the next step may
+// compare against are prefetched while the current one is being compared.
+static int64_t SA_FN(search)(const saidx_t* I, const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize, int64_t st, int64_t en, int64_t* pos)
+{
+  int64_t x, y;
+
+  while (en - st >= 2)
+  {
+    const int64_t mid = st + (en - st) / 2;
+
+    SA_PREFETCH(old + I[st + (mid - st) / 2]);
+    SA_PREFETCH(old + I[mid + (en - mid) / 2]);
+
+    const int less = memcmp(old + I[mid], new, MIN(oldsize - I[mid], newsize)) < 0;
+    st = less ? mid : st;
+    en = less ? en : mid;
+  }
+
+  x = matchlen(old + I[st], oldsize - I[st], new, newsize);
+  y = matchlen(old + I[en], oldsize - I[en], new, newsize);
+
+  if (x > y)
+  {
+    *pos = I[st];
+    return x;
+  }
+  else
+  {
+    *pos = I[en];
+    return y;
+  }
+}
+
+// Whether the suffix of rank x sorts before new, as in search()
+static inline int SA_FN(before)(const saidx_t* I, const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize, int64_t x)
+{
+  return memcmp(old + I[x], new, MIN(oldsize - I[x], newsize)) < 0;
+}
+
+/*
+ * Same as search(), but starting from the suffix of rank r, which should be
+ * close to new in I: gallop away from r until new is bracketed, then binary
+ * search the bracket. Returns -1 if new is more than 2^maxsteps ranks away
+ * from r, the caller should then fall back to search().
+ */
+static int64_t SA_FN(search_near)(const saidx_t* I, const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize, int64_t r, int maxsteps, int64_t* pos)
+{
+  int64_t st, en, step;
+  int steps = 0;
+
+  if (SA_FN(before)(I, old, oldsize, new, newsize, r))
+  {
+    for (st = r, step = 1;; st = en, step <<= 1)
+    {
+      if ((en = st + step) >= oldsize)
+      {
+        en = oldsize;
+        break;
+      }
+      if (!SA_FN(before)(I, old, oldsize, new, newsize, en))
+        break;
+      if (++steps > maxsteps)
+        return -1;
+    }
+  }
+  else
+  {
+    for (en = r, step = 1;; en = st, step <<= 1)
+    {
+      if ((st = en - step) <= 0)
+      {
+        st = 0;
+        break;
+      }
+      if (SA_FN(before)(I, old, oldsize, new, newsize, st))
+        break;
+      if (++steps > maxsteps)
+        return -1;
+    }
+  }
+
+  return SA_FN(search)(I, old, oldsize, new, newsize, st, en, pos);
+}
@@ -0,0 +1,409 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BSDIFF_SIMD_H
+# define BSDIFF_SIMD_H
+
+/*
+ * Byte kernels shared by bsdiff and bspatch. They work on 32 bytes at a
+ * time with the best instruction set the CPU supports, picked at run time,
+ * and fall back to plain C everywhere else. Every kernel returns exactly
+ * what the plain C version does, so patches do not depend on the machine
+ * that made them.
+ *
+ * Define BSDIFF_NO_SIMD to only build the plain C versions.
+ */
+
+# include <stdint.h>
+
+# if !defined(BSDIFF_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define BSDIFF_SIMD_X86
+#  include <immintrin.h>
+# endif
+
+# define SIMD_BLOCK 32
+
+# if defined(__GNUC__)
+#  define SIMD_POPCOUNT(m) __builtin_popcount(m)
+#  define SIMD_CTZ(m) __builtin_ctz(m)
+# else
+static inline int simd_popcount(uint32_t m)
+{
+  m = m - ((m >> 1) & 0x55555555);
+  m = (m & 0x33333333) + ((m >> 2) & 0x33333333);
+  return (int)((((m + (m >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24);
+}
+
+static inline int simd_ctz(uint32_t m)
+{
+  int n = 0;
+
+  while (!(m & 1))
+  {
+    m >>= 1;
+    n++;
+  }
+
+  return n;
+}
+#  define SIMD_POPCOUNT(m) simd_popcount(m)
+#  define SIMD_CTZ(m) simd_ctz(m)
+# endif
+
+// Bit j of the result is set if a[j] == b[j], for j < SIMD_BLOCK
+typedef uint32_t (*simd_eqmask_fn)(const uint8_t* a, const uint8_t* b);
+
+static inline uint32_t simd_eqmask_c(const uint8_t* a, const uint8_t* b)
+{
+  uint32_t mask = 0;
+  int j;
+
+  for (j = 0; j < SIMD_BLOCK; j++)
+    mask |= (uint32_t)(a[j] == b[j]) << j;
+
+  return mask;
+}
+
+# if defined(BSDIFF_SIMD_X86)
+__attribute__((target("sse2")))
+static inline uint32_t simd_eqmask_sse2(const uint8_t* a, const uint8_t* b)
+{
+  const __m128i lo = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)a), _mm_loadu_si128((const __m128i*)b));
+  const __m128i hi = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + 16)), _mm_loadu_si128((const __m128i*)(b + 16)));
+
+  return (uint32_t)_mm_movemask_epi8(lo) | ((uint32_t)_mm_movemask_epi8(hi) << 16);
+}
+
+__attribute__((target("avx2")))
+static inline uint32_t simd_eqmask_avx2(const uint8_t* a, const uint8_t* b)
+{
+  const __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)a), _mm256_loadu_si256((const __m256i*)b));
+
+  return (uint32_t)_mm256_movemask_epi8(eq);
+}
+# endif
+
+static inline simd_eqmask_fn simd_eqmask(void)
+{
+# if defined(BSDIFF_SIMD_X86)
+  if (__builtin_cpu_supports("avx2"))
+    return simd_eqmask_avx2;
+  if (__builtin_cpu_supports("sse2"))
+    return simd_eqmask_sse2;
+# endif
+  return simd_eqmask_c;
+}
+
+// Length of the common prefix of a[0, n) and b[0, n)
+static inline int64_t simd_matchlen(const uint8_t* a, const uint8_t* b, int64_t n)
+{
+  simd_eqmask_fn eqmask;
+  int64_t i = 0;
+
+  // Most matches tried by search() end within a few bytes
+  while (i < n && i < 8 && a[i] == b[i])
+    i++;
+  if (i < 8 || i == n)
+    return i;
+
+  for (eqmask = simd_eqmask(); i + SIMD_BLOCK <= n; i += SIMD_BLOCK)
+  {
+    const uint32_t diff = ~eqmask(a + i, b + i);
+    if (diff != 0)
+      return i + SIMD_CTZ(diff);
+  }
+
+  while (i < n && a[i] == b[i])
+    i++;
+
+  return i;
+}
+
+// Number of j < n such that a[j] == b[j]
+static inline int64_t simd_count_equal(const uint8_t* a, const uint8_t* b, int64_t n)
+{
+  simd_eqmask_fn eqmask = simd_eqmask();
+  int64_t count = 0;
+  int64_t i;
+
+  for (i = 0; i + SIMD_BLOCK <= n; i += SIMD_BLOCK)
+    count += SIMD_POPCOUNT(eqmask(a + i, b + i));
+  for (; i < n; i++)
+    count += (a[i] == b[i]);
+
+  return count;
+}
+
+/*
+ * Extend an approximate match by the shortest length k <= n with the best
+ * score 2 * (equal bytes) - k, if that score is positive. Compares a[j] and
+ * b[j] going forward, or a[-1 - j] and b[-1 - j] going backward.
+ *
+ * k bytes into a block with e equal bytes, the score is at most
+ * 2 * (s + min(k, e)) - (i + k) <= 2 * s - i + e, so the blocks that cannot
+ * beat the best score are only counted.
+ */
+static inline int64_t simd_extend(const uint8_t* a, const uint8_t* b, int64_t n, int backward)
+{
+  simd_eqmask_fn eqmask = simd_eqmask();
+  int64_t s = 0, best = 0, len = 0;
+  int64_t i;
+  int j;
+
+  for (i = 0; i + SIMD_BLOCK <= n; i += SIMD_BLOCK)
+  {
+    const uint32_t mask = backward ? eqmask(a - i - SIMD_BLOCK, b - i - SIMD_BLOCK) : eqmask(a + i, b + i);
+    const int e = SIMD_POPCOUNT(mask);
+
+    if (2 * s - i + e <= best)
+    {
+      s += e;
+      continue;
+    }
+
+    for (j = 0; j < SIMD_BLOCK; j++)
+    {
+      s += (mask >> (backward ? SIMD_BLOCK - 1 - j : j)) & 1;
+      if (2 * s - (i + j + 1) > best)
+      {
+        best = 2 * s - (i + j + 1);
+        len = i + j + 1;
+      }
+    }
+  }
+
+  for (; i < n; i++)
+  {
+    s += backward ? (a[-1 - i] == b[-1 - i]) : (a[i] == b[i]);
+    if (2 * s - (i + 1) > best)
+    {
+      best = 2 * s - (i + 1);
+      len = i + 1;
+    }
+  }
+
+  return len;
+}
+
+/*
+ * Where to split n overlapping bytes between two approximate matches: the
+ * shortest k <= n maximizing the number of a1[j] == b1[j] minus the number
+ * of a2[j] == b2[j] for j < k, if positive. A block can only raise the
+ * running count by its equal bytes in the first match.
+ */
+static inline int64_t simd_split(const uint8_t* a1, const uint8_t* b1, const uint8_t* a2, const uint8_t* b2, int64_t n)
+{
+  simd_eqmask_fn eqmask = simd_eqmask();
+  int64_t s = 0, best = 0, len = 0;
+  int64_t i;
+  int j;
+
+  for (i = 0; i + SIMD_BLOCK <= n; i += SIMD_BLOCK)
+  {
+    const uint32_t m1 = eqmask(a1 + i, b1 + i);
+    const uint32_t m2 = eqmask(a2 + i, b2 + i);
+
+    if (s + SIMD_POPCOUNT(m1) <= best)
+    {
+      s += SIMD_POPCOUNT(m1) - SIMD_POPCOUNT(m2);
+      continue;
+    }
+
+    for (j = 0; j < SIMD_BLOCK; j++)
+    {
+      s += (int)((m1 >> j) & 1) - (int)((m2 >> j) & 1);
+      if (s > best)
+      {
+        best = s;
+        len = i + j + 1;
+      }
+    }
+  }
+
+  for (; i < n; i++)
+  {
+    s += (a1[i] == b1[i]) - (a2[i] == b2[i]);
+    if (s > best)
+    {
+      best = s;
+      len = i + 1;
+    }
+  }
+
+  return len;
+}
+
+// dst[j] = a[j] - b[j] for j < n, as bsdiff writes diff data
+typedef void (*simd_sub_fn)(uint8_t* dst, const uint8_t* a, const uint8_t* b, int64_t n);
+// dst[j] += src[j] for j < n, as bspatch applies it
+typedef void (*simd_add_fn)(uint8_t* dst, const uint8_t* src, int64_t n);
+
+static inline void simd_sub_c(uint8_t* dst, const uint8_t* a, const uint8_t* b, int64_t n)
+{
+  int64_t i;
+
+  for (i = 0; i < n; i++)
+    dst[i] = a[i] - b[i];
+}
+
+static inline void simd_add_c(uint8_t* dst, const uint8_t* src, int64_t n)
+{
+  int64_t i;
+
+  for (i = 0; i < n; i++)
+    dst[i] += src[i];
+}
+
+# if defined(BSDIFF_SIMD_X86)
+__attribute__((target("sse2")))
+static inline void simd_sub_sse2(uint8_t* dst, const uint8_t* a, const uint8_t* b, int64_t n)
+{
+  int64_t i;
+
+  for (i = 0; i + 16 <= n; i += 16)
+  {
+    const __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+    const __m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_sub_epi8(x, y));
+  }
+  simd_sub_c(dst + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static inline void simd_add_sse2(uint8_t* dst, const uint8_t* src, int64_t n)
+{
+  int64_t i;
+
+  for (i = 0; i + 16 <= n; i += 16)
+  {
+    const __m128i x = _mm_loadu_si128((const __m128i*)(dst + i));
+    const __m128i y = _mm_loadu_si128((const __m128i*)(src + i));
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_add_epi8(x, y));
+  }
+  simd_add_c(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static inline void simd_sub_avx2(uint8_t* dst, const uint8_t* a, const uint8_t* b, int64_t n)
+{
+  int64_t i;
+
+  for (i = 0; i + 32 <= n; i += 32)
+  {
+    const __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+    const __m256i y = _mm256_loadu_si256((const __m256i*)(b + i));
+    _mm256_storeu_si256((__m256i*)(dst + i), _mm256_sub_epi8(x, y));
+  }
+  simd_sub_c(dst + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static inline void simd_add_avx2(uint8_t* dst, const uint8_t* src, int64_t n)
+{
+  int64_t i;
+
+  for (i = 0; i + 32 <= n; i += 32)
+  {
+    const __m256i x = _mm256_loadu_si256((const __m256i*)(dst + i));
+    const __m256i y = _mm256_loadu_si256((const __m256i*)(src + i));
+    _mm256_storeu_si256((__m256i*)(dst + i), _mm256_add_epi8(x, y));
+  }
+  simd_add_c(dst + i, src + i, n - i);
+}
+# endif
+
+static inline void simd_sub(uint8_t* dst, const uint8_t* a, const uint8_t* b, int64_t n)
+{
+# if defined(BSDIFF_SIMD_X86)
+  if (__builtin_cpu_supports("avx2"))
+    simd_sub_avx2(dst, a, b, n);
+  else if (__builtin_cpu_supports("sse2"))
+    simd_sub_sse2(dst, a, b, n);
+  else
+# endif
+    simd_sub_c(dst, a, b, n);
+}
+
+static inline void simd_add(uint8_t* dst, const uint8_t* src, int64_t n)
+{
+# if defined(BSDIFF_SIMD_X86)
+  if (__builtin_cpu_supports("avx2"))
+    simd_add_avx2(dst, src, n);
+  else if (__builtin_cpu_supports("sse2"))
+    simd_add_sse2(dst, src, n);
+  else
+# endif
+    simd_add_c(dst, src, n);
+}
+
+// Whether p[0, n) is all zeros, for sparse output
+static inline int simd_is_zero_c(const uint8_t* p, int64_t n)
+{
+  uint8_t acc = 0;
+  int64_t i;
+
+  for (i = 0; i < n; i++)
+    acc |= p[i];
+  return acc == 0;
+}
+
+# if defined(BSDIFF_SIMD_X86)
+__attribute__((target("sse2")))
+static inline int simd_is_zero_sse2(const uint8_t* p, int64_t n)
+{
+  __m128i acc = _mm_setzero_si128();
+  int64_t i;
+
+  for (i = 0; i + 16 <= n; i += 16)
+    acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i*)(p + i)));
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) == 0xffff && simd_is_zero_c(p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static inline int simd_is_zero_avx2(const uint8_t* p, int64_t n)
+{
+  __m256i acc = _mm256_setzero_si256();
+  int64_t i;
+
+  for (i = 0; i + 32 <= n; i += 32)
+    acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i*)(p + i)));
+  return _mm256_testz_si256(acc, acc) && simd_is_zero_c(p + i, n - i);
+}
+# endif
+
+static inline int simd_is_zero(const uint8_t* p, int64_t n)
+{
+# if defined(BSDIFF_SIMD_X86)
+  if (__builtin_cpu_supports("avx2"))
+    return simd_is_zero_avx2(p, n);
+  if (__builtin_cpu_supports("sse2"))
+    return simd_is_zero_sse2(p, n);
+# endif
+  return simd_is_zero_c(p, n);
+}
+
+#endif
@@ -25,7 +25,15 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#if defined(BSPATCH_EXECUTABLE) && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE /* fallocate() */
+#endif
+
 #include "bspatch.h"
+#include "bsdiff_simd.h"
+
+#include <stdlib.h>
+#include <string.h>
 
 static int64_t offtin(uint8_t* buf)
 {
@@ -53,38 +61,334 @@ static int64_t offtin(uint8_t* buf)
   return y;
 }
 
+/*
+ * Control records, read a chunk at a time for BSPATCH_CTRL_VARINT (see
+ * bsdiff.c for the encoding) and one at a time for BSPATCH_CTRL_FIXED.
+ */
+#define CTRL_CHUNK_SIZE (1 << 14)
+
+struct ctrl_reader
+{
+  struct bspatch_stream* stream;
+  int varint;
+  uint8_t buffer[CTRL_CHUNK_SIZE];
+  size_t pos;
+  size_t end;
+};
+
+static int get_varint(const uint8_t* buffer, size_t* pos, size_t end, uint64_t* x)
+{
+  int shift;
+
+  *x = 0;
+  for (shift = 0; shift < 64 && *pos < end; shift += 7)
+  {
+    const uint8_t byte = buffer[(*pos)++];
+    *x |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return 0;
+  }
+
+  return -1;
+}
+
+// Decode a varint record from buffer[*pos, end)
+static int decode_ctrl(const uint8_t* buffer, size_t* pos, size_t end, int64_t ctrl[3])
+{
+  uint64_t x[3];
+  int i;
+
+  for (i = 0; i <= 2; i++)
+    if (get_varint(buffer, pos, end, &x[i]))
+      return -1;
+  if (x[0] > INT64_MAX || x[1] > INT64_MAX)
+    return -1;
+
+  ctrl[0] = x[0];
+  ctrl[1] = x[1];
+  ctrl[2] = (int64_t)(x[2] >> 1) ^ -(int64_t)(x[2] & 1);
+
+  return 0;
+}
+
+static size_t get_chunk_size(const uint8_t* buf)
+{
+  return buf[0] | (buf[1] << 8) | ((size_t)buf[2] << 16) | ((size_t)buf[3] << 24);
+}
+
+static int read_ctrl(struct ctrl_reader* r, int64_t ctrl[3])
+{
+  int i;
+
+  if (!r->varint)
+  {
+    if (r->stream->read(r->stream, r->buffer, 8 * 3))
+      return -1;
+    for (i = 0; i <= 2; i++)
+      ctrl[i] = offtin(r->buffer + 8 * i);
+    return 0;
+  }
+
+  if (r->pos == r->end)
+  {
+    if (r->stream->read(r->stream, r->buffer, 4))
+      return -1;
+    r->end = get_chunk_size(r->buffer);
+    r->pos = 0;
+    if (r->end == 0 || r->end > sizeof(r->buffer) || r->stream->read(r->stream, r->buffer, r->end))
+      return -1;
+  }
+
+  // Records never straddle chunks
+  return decode_ctrl(r->buffer, &r->pos, r->end, ctrl);
+}
+
+void bspatch_options_init(struct bspatch_options* opts)
+{
+  opts->ctrl_format = BSPATCH_CTRL_FIXED;
+  opts->cache_size = 4 << 20;
+}
+
 int bspatch(const uint8_t* old, int64_t oldsize, uint8_t* new, int64_t newsize, struct bspatch_stream* stream)
 {
-  uint8_t buf[8];
+  return bspatch_channels(old, oldsize, new, newsize, stream, stream, stream);
+}
+
+int bspatch_channels(const uint8_t* old, int64_t oldsize, uint8_t* new, int64_t newsize,
+                     struct bspatch_stream* ctrlstream, struct bspatch_stream* diffstream, struct bspatch_stream* extrastream)
+{
+  struct bspatch_options opts;
+
+  bspatch_options_init(&opts);
+  return bspatch_channels_ex(old, oldsize, new, newsize, ctrlstream, diffstream, extrastream, &opts);
+}
+
+/*
+ * Old is read from memory, or through old->pread() into a cache of
+ * OLD_BLOCK sized blocks, the least recently used of which is replaced.
+ */
+#define OLD_BLOCK (1 << 16)
+
+struct old_source
+{
+  const uint8_t* data;
+  int64_t size;
+  const struct bspatch_old* old;
+  uint8_t* blocks;
+  int64_t* index;
+  uint64_t* stamp;
+  uint64_t clock;
+  size_t count;
+};
+
+static const uint8_t* old_block(struct old_source* src, int64_t block)
+{
+  int64_t offset, length;
+  size_t i, victim = 0;
+
+  src->clock++;
+  for (i = 0; i < src->count; i++)
+  {
+    if (src->index[i] == block)
+    {
+      src->stamp[i] = src->clock;
+      return src->blocks + i * OLD_BLOCK;
+    }
+    if (src->stamp[i] < src->stamp[victim])
+      victim = i;
+  }
+
+  offset = block * OLD_BLOCK;
+  length = (src->size - offset < OLD_BLOCK) ? src->size - offset : OLD_BLOCK;
+  src->index[victim] = -1;
+  if (src->old->pread(src->old, src->blocks + victim * OLD_BLOCK, length, offset))
+    return NULL;
+  src->index[victim] = block;
+  src->stamp[victim] = src->clock;
+
+  return src->blocks + victim * OLD_BLOCK;
+}
+
+/* Add old[oldpos, oldpos + n) to p[0, n), where it is within old */
+static int add_old(struct old_source* src, uint8_t* p, int64_t oldpos, int64_t n)
+{
+  const uint8_t* block;
+  int64_t lo, hi, m;
+
+  lo = (oldpos < 0) ? -oldpos : 0;
+  hi = (oldpos + n > src->size) ? src->size - oldpos : n;
+  if (src->old == NULL)
+  {
+    if (lo < hi)
+      simd_add(p + lo, src->data + oldpos + lo, hi - lo);
+    return 0;
+  }
+
+  for (; lo < hi; lo += m)
+  {
+    m = OLD_BLOCK - (oldpos + lo) % OLD_BLOCK;
+    m = (m < hi - lo) ? m : hi - lo;
+    if ((block = old_block(src, (oldpos + lo) / OLD_BLOCK)) == NULL)
+      return -1;
+    simd_add(p + lo, block + (oldpos + lo) % OLD_BLOCK, m);
+  }
+
+  return 0;
+}
+
+/*
+ * When the control stream is on its own, records are read up to
+ * PLAN_RECORDS ahead of the one being applied, and the parts of old they
+ * add are handed to old->readahead(), merged into runs.
+ */
+#define PLAN_RECORDS 64
+
+struct ctrl_plan
+{
+  struct ctrl_reader reader;
+  int64_t records[PLAN_RECORDS][3];
+  size_t head, queued, depth;
+  int64_t oldpos, newpos, newsize;
+  int64_t hint_start, hint_end;
+};
+
+static void plan_hint(struct ctrl_plan* plan, struct old_source* src, int64_t start, int64_t end)
+{
+  if (plan->hint_start == plan->hint_end || start < plan->hint_start || start > plan->hint_end + OLD_BLOCK)
+  {
+    if (plan->hint_start < plan->hint_end)
+      src->old->readahead(src->old, plan->hint_start, plan->hint_end - plan->hint_start);
+    plan->hint_start = start;
+    plan->hint_end = start;
+  }
+  if (end > plan->hint_end)
+    plan->hint_end = end;
+}
+
+static int plan_next(struct ctrl_plan* plan, struct old_source* src, int64_t ctrl[3])
+{
+  int64_t* r;
+  int64_t start, end;
+
+  while (plan->queued < plan->depth && plan->newpos < plan->newsize)
+  {
+    r = plan->records[(plan->head + plan->queued) % PLAN_RECORDS];
+    if (read_ctrl(&plan->reader, r))
+      return -1;
+    plan->queued++;
+
+    // Stop at a record that cannot be applied, it fails when it is
+    if (r[0] < 0 || r[1] < 0 || r[0] > plan->newsize - plan->newpos || r[1] > plan->newsize - plan->newpos - r[0])
+    {
+      plan->newpos = plan->newsize;
+      break;
+    }
+
+    start = (plan->oldpos > 0) ? plan->oldpos : 0;
+    end = (plan->oldpos + r[0] < src->size) ? plan->oldpos + r[0] : src->size;
+    if (start < end && src->old != NULL && src->old->readahead != NULL)
+      plan_hint(plan, src, start, end);
+
+    plan->newpos += r[0] + r[1];
+    plan->oldpos += r[0] + r[2];
+  }
+  if (plan->hint_start < plan->hint_end)
+  {
+    src->old->readahead(src->old, plan->hint_start, plan->hint_end - plan->hint_start);
+    plan->hint_start = plan->hint_end;
+  }
+
+  if (plan->queued == 0)
+    return -1;
+  memcpy(ctrl, plan->records[plan->head], sizeof(plan->records[0]));
+  plan->head = (plan->head + 1) % PLAN_RECORDS;
+  plan->queued--;
+
+  return 0;
+}
+
+/*
+ * new is produced through a window: either all of new, or a buffer that is
+ * handed to output whenever it fills up.
+ */
+#define OUTPUT_WINDOW (1 << 16)
+
+struct window
+{
+  uint8_t* buffer;
+  int64_t capacity;
+  int64_t used;
+  const struct bspatch_output* output;
+};
+
+/* Read length bytes of stream into the window. When src is not NULL, they
+ * are a diff string against old[oldpos, oldpos + length). */
+static int window_read(struct window* w, struct bspatch_stream* stream, int64_t length,
+                       struct old_source* src, int64_t oldpos)
+{
+  int64_t n;
+  uint8_t* p;
+
+  while (length > 0)
+  {
+    n = (length < w->capacity - w->used) ? length : w->capacity - w->used;
+    p = w->buffer + w->used;
+    if (stream->read(stream, p, n))
+      return -1;
+    if (src != NULL && add_old(src, p, oldpos, n))
+      return -1;
+
+    w->used += n;
+    oldpos += n;
+    length -= n;
+    if (w->used == w->capacity && w->output != NULL)
+    {
+      if (w->output->write(w->output, w->buffer, w->used))
+        return -1;
+      w->used = 0;
+    }
+  }
+
+  return 0;
+}
+
+static int bspatch_window(struct old_source* src, int64_t newsize, struct window* w,
+                          struct bspatch_stream* ctrlstream, struct bspatch_stream* diffstream, struct bspatch_stream* extrastream,
+                          const struct bspatch_options* opts)
+{
+  struct ctrl_plan plan;
   int64_t oldpos, newpos;
   int64_t ctrl[3];
-  int64_t i;
+
+  plan.reader.stream = ctrlstream;
+  plan.reader.varint = (opts->ctrl_format == BSPATCH_CTRL_VARINT);
+  plan.reader.pos = 0;
+  plan.reader.end = 0;
+  plan.head = 0;
+  plan.queued = 0;
+  plan.depth = (src->old != NULL && ctrlstream != diffstream && ctrlstream != extrastream) ? PLAN_RECORDS : 1;
+  plan.oldpos = 0;
+  plan.newpos = 0;
+  plan.newsize = newsize;
+  plan.hint_start = 0;
+  plan.hint_end = 0;
 
   oldpos = 0;
   newpos = 0;
   while (newpos < newsize)
-{
+  {
     /* Read control data */
-    for (i = 0; i <= 2; i++)
-{
-      if (stream->read(stream, buf, 8))
-        return -1;
-      ctrl[i] = offtin(buf);
-    };
+    if (plan_next(&plan, src, ctrl))
+      return -1;
 
     /* Sanity-check */
-    if (newpos + ctrl[0] > newsize)
+    if (ctrl[0] < 0 || ctrl[1] < 0 || newpos + ctrl[0] > newsize)
       return -1;
 
-    /* Read diff string */
-    if (stream->read(stream, new + newpos, ctrl[0]))
+    /* Read diff string and add old data to it */
+    if (window_read(w, diffstream, ctrl[0], src, oldpos))
       return -1;
 
-    /* Add old data to diff string */
-    for (i = 0; i < ctrl[0]; i++)
-      if ((oldpos + i >= 0) && (oldpos + i < oldsize))
-        new[newpos + i] += old[oldpos + i];
-
     /* Adjust pointers */
     newpos += ctrl[0];
     oldpos += ctrl[0];
@@ -94,7 +398,7 @@ int bspatch(const uint8_t* old, int64_t oldsize, uint8_t* new, int64_t newsize,
       return -1;
 
     /* Read extra string */
-    if (stream->read(stream, new + newpos, ctrl[1]))
+    if (window_read(w, extrastream, ctrl[1], NULL, 0))
       return -1;
 
     /* Adjust pointers */
@@ -102,96 +406,877 @@ int bspatch(const uint8_t* old, int64_t oldsize, uint8_t* new, int64_t newsize,
     oldpos += ctrl[2];
   };
 
+  /* Hand over the rest of new */
+  if (w->output != NULL && w->used > 0)
+    return w->output->write(w->output, w->buffer, w->used) ? -1 : 0;
+
+  return 0;
+}
+
+static void old_memory(struct old_source* src, const uint8_t* old, int64_t oldsize)
+{
+  src->data = old;
+  src->size = oldsize;
+  src->old = NULL;
+}
+
+int bspatch_channels_ex(const uint8_t* old, int64_t oldsize, uint8_t* new, int64_t newsize,
+                        struct bspatch_stream* ctrlstream, struct bspatch_stream* diffstream, struct bspatch_stream* extrastream,
+                        const struct bspatch_options* opts)
+{
+  struct old_source src;
+  struct window w;
+
+  old_memory(&src, old, oldsize);
+  w.buffer = new;
+  w.capacity = newsize;
+  w.used = 0;
+  w.output = NULL;
+  return bspatch_window(&src, newsize, &w, ctrlstream, diffstream, extrastream, opts);
+}
+
+int bspatch_streaming(const uint8_t* old, int64_t oldsize, int64_t newsize,
+                      struct bspatch_stream* ctrlstream, struct bspatch_stream* diffstream, struct bspatch_stream* extrastream,
+                      const struct bspatch_options* opts, const struct bspatch_output* output)
+{
+  uint8_t buffer[OUTPUT_WINDOW];
+  struct old_source src;
+  struct window w;
+
+  old_memory(&src, old, oldsize);
+  w.buffer = buffer;
+  w.capacity = OUTPUT_WINDOW;
+  w.used = 0;
+  w.output = output;
+  return bspatch_window(&src, newsize, &w, ctrlstream, diffstream, extrastream, opts);
+}
+
+int bspatch_pread(const struct bspatch_old* old, int64_t oldsize, int64_t newsize,
+                  struct bspatch_stream* ctrlstream, struct bspatch_stream* diffstream, struct bspatch_stream* extrastream,
+                  const struct bspatch_options* opts, const struct bspatch_output* output)
+{
+  uint8_t buffer[OUTPUT_WINDOW];
+  struct old_source src;
+  struct window w;
+  size_t i;
+  int ret = -1;
+
+  src.data = NULL;
+  src.size = oldsize;
+  src.old = old;
+  src.clock = 0;
+  src.count = (opts->cache_size + OLD_BLOCK - 1) / OLD_BLOCK;
+  src.count = (src.count > 0) ? src.count : 1;
+  src.blocks = malloc(src.count * OLD_BLOCK);
+  src.index = malloc(src.count * sizeof(int64_t));
+  src.stamp = malloc(src.count * sizeof(uint64_t));
+  if (src.blocks != NULL && src.index != NULL && src.stamp != NULL)
+  {
+    for (i = 0; i < src.count; i++)
+    {
+      src.index[i] = -1;
+      src.stamp[i] = 0;
+    }
+
+    w.buffer = buffer;
+    w.capacity = OUTPUT_WINDOW;
+    w.used = 0;
+    w.output = output;
+    ret = bspatch_window(&src, newsize, &w, ctrlstream, diffstream, extrastream, opts);
+  }
+
+  free(src.blocks);
+  free(src.index);
+  free(src.stamp);
+
+  return ret;
+}
+
+/*
+ * Incremental patching of a single stream, one stage at a time. Stages
+ * remember how many bytes they still need, and a control record is gathered
+ * in ctx->pending until it is whole.
+ */
+enum
+{
+  STAGE_CHUNK,
+  STAGE_CTRL,
+  STAGE_DIFF,
+  STAGE_EXTRA,
+  STAGE_DONE,
+  STAGE_FAILED
+};
+
+#define FEED_CHUNK (1 << 14)
+
+// Start on the next control record, or finish
+static void next_record(struct bspatch_ctx* ctx)
+{
+  ctx->have = 0;
+  if (ctx->newpos == ctx->newsize)
+    ctx->stage = STAGE_DONE;
+  else if (ctx->varint)
+  {
+    ctx->stage = STAGE_CHUNK;
+    ctx->need = 4;
+  }
+  else
+  {
+    ctx->stage = STAGE_CTRL;
+    ctx->need = 8 * 3;
+  }
+}
+
+// Move on from a string once it is done, even when it is empty
+static void next_stage(struct bspatch_ctx* ctx)
+{
+  if (ctx->stage == STAGE_DIFF && ctx->left == 0)
+  {
+    ctx->stage = STAGE_EXTRA;
+    ctx->left = ctx->ctrl[1];
+  }
+  if (ctx->stage == STAGE_EXTRA && ctx->left == 0)
+  {
+    ctx->oldpos += ctx->ctrl[2];
+    next_record(ctx);
+  }
+}
+
+// A whole control record (or chunk size) is in ctx->pending
+static int parse_pending(struct bspatch_ctx* ctx)
+{
+  size_t pos = 0;
+  int i;
+
+  if (ctx->stage == STAGE_CHUNK)
+  {
+    // In a single stream, every chunk holds a single record
+    ctx->need = get_chunk_size(ctx->pending);
+    ctx->have = 0;
+    ctx->stage = STAGE_CTRL;
+    return (ctx->need == 0 || ctx->need > (int)sizeof(ctx->pending)) ? -1 : 0;
+  }
+
+  if (!ctx->varint)
+  {
+    for (i = 0; i <= 2; i++)
+      ctx->ctrl[i] = offtin(ctx->pending + 8 * i);
+  }
+  else if (decode_ctrl(ctx->pending, &pos, ctx->need, ctx->ctrl) || pos != (size_t)ctx->need)
+    return -1;
+
+  /* Sanity-check */
+  if (ctx->ctrl[0] < 0 || ctx->ctrl[1] < 0 || ctx->ctrl[0] > ctx->newsize - ctx->newpos ||
+      ctx->ctrl[1] > ctx->newsize - ctx->newpos - ctx->ctrl[0])
+    return -1;
+
+  ctx->stage = STAGE_DIFF;
+  ctx->left = ctx->ctrl[0];
+  next_stage(ctx);
+
+  return 0;
+}
+
+// Add old data to n bytes of diff string, or copy n bytes of extra string
+static int feed_string(struct bspatch_ctx* ctx, const uint8_t* buf, int n)
+{
+  uint8_t scratch[FEED_CHUNK];
+  uint8_t* p = (ctx->new != NULL) ? ctx->new + ctx->newpos : scratch;
+  int64_t lo, hi;
+
+  memcpy(p, buf, n);
+  if (ctx->stage == STAGE_DIFF)
+  {
+    lo = (ctx->oldpos < 0) ? -ctx->oldpos : 0;
+    hi = (ctx->oldpos + n > ctx->oldsize) ? ctx->oldsize - ctx->oldpos : n;
+    if (lo < hi)
+      simd_add(p + lo, ctx->old + ctx->oldpos + lo, hi - lo);
+    ctx->oldpos += n;
+  }
+  if (ctx->new == NULL && ctx->output->write(ctx->output, p, n))
+    return -1;
+
+  ctx->newpos += n;
+  ctx->left -= n;
+  next_stage(ctx);
+
+  return 0;
+}
+
+int bspatch_init(struct bspatch_ctx* ctx, const uint8_t* old, int64_t oldsize, uint8_t* new, int64_t newsize,
+                 const struct bspatch_options* opts, const struct bspatch_output* output)
+{
+  ctx->old = old;
+  ctx->oldsize = oldsize;
+  ctx->new = new;
+  ctx->newsize = newsize;
+  ctx->output = output;
+  ctx->varint = (opts->ctrl_format == BSPATCH_CTRL_VARINT);
+  ctx->oldpos = 0;
+  ctx->newpos = 0;
+  ctx->left = 0;
+  next_record(ctx);
+
+  if (newsize < 0 || (new == NULL && output == NULL))
+  {
+    ctx->stage = STAGE_FAILED;
+    return -1;
+  }
+
+  return 0;
+}
+
+int bspatch_feed(struct bspatch_ctx* ctx, const void* buffer, size_t length)
+{
+  const uint8_t* buf = buffer;
+  int64_t n;
+
+  while (length > 0)
+  {
+    switch (ctx->stage)
+    {
+    case STAGE_CHUNK:
+    case STAGE_CTRL:
+      n = ctx->need - ctx->have;
+      n = ((size_t)n < length) ? n : (int64_t)length;
+      memcpy(ctx->pending + ctx->have, buf, n);
+      ctx->have += n;
+      if (ctx->have == ctx->need && parse_pending(ctx))
+        ctx->stage = STAGE_FAILED;
+      break;
+
+    case STAGE_DIFF:
+    case STAGE_EXTRA:
+      n = (ctx->left < FEED_CHUNK) ? ctx->left : FEED_CHUNK;
+      n = ((size_t)n < length) ? n : (int64_t)length;
+      if (feed_string(ctx, buf, n))
+        ctx->stage = STAGE_FAILED;
+      break;
+
+    default:
+      // Failed before, or data past the end of the patch
+      ctx->stage = STAGE_FAILED;
+      return -1;
+    }
+
+    buf += n;
+    length -= n;
+  }
+
+  return (ctx->stage == STAGE_FAILED) ? -1 : 0;
+}
+
+int bspatch_finish(struct bspatch_ctx* ctx)
+{
+  return (ctx->stage == STAGE_DONE) ? 0 : -1;
+}
+
+/*
+ * In-place patches are a list of copies and literals, see bsdiff.c. Each
+ * copy is built in a scratch buffer, since it may overlap itself.
+ */
+#define INPLACE_CHUNK (1 << 14)
+
+int bspatch_inplace(uint8_t* buffer, int64_t oldsize, int64_t newsize, struct bspatch_stream* stream)
+{
+  uint8_t scratch[INPLACE_CHUNK];
+  uint8_t buf[8 * 3];
+  int64_t len, dst, src;
+  int64_t written = 0;
+
+  while (written < newsize)
+  {
+    if (stream->read(stream, buf, sizeof(buf)))
+      return -1;
+    len = offtin(buf);
+    dst = offtin(buf + 8);
+    src = offtin(buf + 16);
+
+    /* Sanity-check */
+    if (len <= 0 || dst < 0 || dst > newsize - len || src < -1)
+      return -1;
+
+    if (src >= 0)
+    {
+      if (len > INPLACE_CHUNK || src > oldsize - len || stream->read(stream, scratch, len))
+        return -1;
+      simd_add(scratch, buffer + src, len);
+      memcpy(buffer + dst, scratch, len);
+    }
+    else if (stream->read(stream, buffer + dst, len))
+      return -1;
+
+    written += len;
+  }
+
   return 0;
 }
 
 #if defined(BSPATCH_EXECUTABLE)
 
-#include <bzlib.h>
+#include "codec.h"
+#include "threadpool.h"
+
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <err.h>
+#include <errno.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
 
-static int bz2_read(const struct bspatch_stream* stream, void* buffer, int length)
+static int codec_stream_read(const struct bspatch_stream* stream, void* buffer, int length)
+{
+  return codec_read(stream->opaque, buffer, length);
+}
+
+static int codec_frame_stream_read(const struct bspatch_stream* stream, void* buffer, int length)
 {
-  int n;
-  int bz2err;
-  BZFILE* bz2;
+  return codec_frame_read(stream->opaque, buffer, length);
+}
 
-  bz2 = (BZFILE*)stream->opaque;
-  n = BZ2_bzRead(&bz2err, bz2, buffer, length);
-  if (n != length)
-    return -1;
+static int writeAll(int fd, const uint8_t* p, int64_t length)
+{
+  ssize_t n;
+
+  while (length > 0)
+  {
+    if ((n = write(fd, p, (length < (1 << 30)) ? length : (1 << 30))) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += n;
+    length -= n;
+  }
 
   return 0;
 }
 
-int main(int argc, char* argv[])
+/*
+ * With -S, blocks of new that are all zeros are left as holes: seeked over
+ * when new is written, punched out when it is mapped.
+ */
+#define SPARSE_BLOCK 4096
+
+// End of the run of blocks from pos that are all zeros, or not
+static int64_t sparseRun(const uint8_t* data, int64_t pos, int64_t size, int* zero)
+{
+  int64_t n = (size - pos < SPARSE_BLOCK) ? size - pos : SPARSE_BLOCK;
+
+  *zero = simd_is_zero(data + pos, n);
+  for (pos += n; pos < size; pos += n)
+  {
+    n = (size - pos < SPARSE_BLOCK) ? size - pos : SPARSE_BLOCK;
+    if (simd_is_zero(data + pos, n) != *zero)
+      break;
+  }
+
+  return pos;
+}
+
+// Write data at the current offset of fd, the file is sized afterwards
+static int writeSparse(int fd, const uint8_t* data, int64_t size, int64_t* skipped)
+{
+  int64_t pos, end;
+  int zero;
+
+  for (pos = 0; pos < size; pos = end)
+  {
+    end = sparseRun(data, pos, size, &zero);
+    if (!zero)
+    {
+      if (writeAll(fd, data + pos, end - pos))
+        return -1;
+    }
+    else if (lseek(fd, end - pos, SEEK_CUR) < 0)
+      return -1;
+    else
+      *skipped += end - pos;
+  }
+
+  return 0;
+}
+
+// Punch out the zero blocks of data, mapped from fd, as far as the file
+// system allows
+static void punchHoles(int fd, const uint8_t* data, int64_t size, int64_t* skipped)
+{
+#if defined(FALLOC_FL_PUNCH_HOLE)
+  int64_t pos, end;
+  int zero;
+
+  for (pos = 0; pos < size; pos = end)
+  {
+    end = sparseRun(data, pos, size, &zero);
+    if (zero)
+    {
+      if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, end - pos) != 0)
+        return;
+      *skipped += end - pos;
+    }
+  }
+#else
+  (void)fd;
+  (void)data;
+  (void)size;
+  (void)skipped;
+#endif
+}
+
+static void reportSparse(const char* path, const int64_t* skipped)
+{
+  if (skipped != NULL)
+    fprintf(stderr, "%s: %lld bytes of zeros left as holes\n", path, (long long)*skipped);
+}
+
+/*
+ * A new regular file is written to a temporary file in the same directory,
+ * and renamed over it only once it is complete: a patch that fails leaves
+ * the file as it was, even when it is also the old file. The temporary file
+ * is removed if bspatch exits before. Symbolic links are followed, so that
+ * the file they point to is replaced rather than the links.
+ */
+static char* pendingTemp;
+static char* pendingTarget;
+
+static void removeTemp(void)
+{
+  if (pendingTemp != NULL)
+    unlink(pendingTemp);
+}
+
+static int createTemp(const char* path, mode_t mode)
+{
+  const mode_t mask = umask(0);
+  const char* slash;
+  const char* base;
+  int fd;
+
+  umask(mask);
+  if ((pendingTarget = realpath(path, NULL)) == NULL && (errno != ENOENT || (pendingTarget = strdup(path)) == NULL))
+    err(1, "%s", path);
+  slash = strrchr(pendingTarget, '/');
+  base = (slash != NULL) ? slash + 1 : pendingTarget;
+  if ((pendingTemp = malloc(strlen(pendingTarget) + 9)) == NULL)
+    err(1, NULL);
+  sprintf(pendingTemp, "%.*s.%s.XXXXXX", (int)(base - pendingTarget), pendingTarget, base);
+  if ((fd = mkstemp(pendingTemp)) < 0)
+  {
+    free(pendingTemp);
+    pendingTemp = NULL;
+    err(1, "%s", path);
+  }
+  atexit(removeTemp);
+  if (fchmod(fd, mode & 07777 & ~mask) != 0)
+    err(1, "%s", path);
+
+  return fd;
+}
+
+// Put the temporary file in place of path, once it is closed
+static void commitTemp(const char* path)
+{
+  if (rename(pendingTemp, pendingTarget) != 0)
+    err(1, "%s", path);
+  free(pendingTemp);
+  free(pendingTarget);
+  pendingTemp = NULL;
+}
+
+/*
+ * Files are mapped rather than read or written with copies. A file that is
+ * not mapped (empty, or the patch when it is also the new file) is a plain
+ * buffer.
+ */
+struct file
+{
+  uint8_t* data;
+  int64_t size;
+  int mapped;
+};
+
+static void loadFile(const char* path, struct file* file, struct stat* sb, int advice, int map)
 {
-  FILE* f;
   int fd;
-  int bz2err;
-  uint8_t header[24];
-  uint8_t *old, *new;
-  int64_t oldsize, newsize;
-  BZFILE* bz2;
-  struct bspatch_stream stream;
+
+  if ((fd = open(path, O_RDONLY, 0)) < 0 || fstat(fd, sb) != 0)
+    err(1, "%s", path);
+
+  file->size = sb->st_size;
+  file->mapped = map && file->size > 0;
+  if (file->mapped)
+  {
+    if ((file->data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+      err(1, "mmap(%s)", path);
+    madvise(file->data, file->size, advice);
+  }
+  else if ((file->data = malloc(file->size + 1)) == NULL || read(fd, file->data, file->size) != file->size)
+    err(1, "%s", path);
+
+  close(fd);
+}
+
+// Whether path is the same file as sb, which then cannot stay mapped while
+// path is truncated
+static int sameFile(const char* path, const struct stat* sb)
+{
+  struct stat other;
+
+  return stat(path, &other) == 0 && other.st_dev == sb->st_dev && other.st_ino == sb->st_ino;
+}
+
+// The new file is created at its final size, and bspatch writes to its pages.
+// A sparse file is not allocated up front, its zero blocks are punched out
+// by closeFile.
+static int createFile(const char* path, struct file* file, int64_t size, mode_t mode, int sparse)
+{
+  const int fd = createTemp(path, mode);
+
+  file->size = size;
+  file->mapped = size > 0;
+  if (!file->mapped)
+  {
+    if ((file->data = malloc(size + 1)) == NULL)
+      err(1, NULL);
+    return fd;
+  }
+
+  // Allocate the blocks now, rather than get SIGBUS on a full disk
+  if (ftruncate(fd, size) != 0 || (!sparse && posix_fallocate(fd, 0, size) != 0))
+    errx(1, "%s: could not allocate %lld bytes", path, (long long)size);
+  if ((file->data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    err(1, "mmap(%s)", path);
+  madvise(file->data, size, MADV_SEQUENTIAL);
+
+  return fd;
+}
+
+// Write the new file when it is not mapped; skipped is NULL unless -S
+static void closeFile(const char* path, struct file* file, int fd, int64_t* skipped)
+{
+  if (file->mapped)
+  {
+    if (skipped != NULL)
+      punchHoles(fd, file->data, file->size, skipped);
+    if (munmap(file->data, file->size) != 0)
+      err(1, "%s", path);
+  }
+  else
+  {
+    if (fd >= 0 && skipped == NULL && writeAll(fd, file->data, file->size))
+      err(1, "%s", path);
+    if (fd >= 0 && skipped != NULL && (writeSparse(fd, file->data, file->size, skipped) || ftruncate(fd, file->size) != 0))
+      err(1, "%s", path);
+    free(file->data);
+  }
+  if (fd >= 0 && close(fd) == -1)
+    err(1, "%s", path);
+}
+
+/*
+ * Pipes and devices cannot be mapped or sized up front: new is written to
+ * them as bspatch_streaming() produces it, and an old device is read
+ * through bspatch_pread()
+ */
+struct output
+{
+  int fd;
+  int64_t* skipped;
+};
+
+static int output_write(const struct bspatch_output* output, const void* buffer, int length)
+{
+  const struct output* out = output->opaque;
+
+  if (out->skipped != NULL)
+    return writeSparse(out->fd, buffer, length, out->skipped);
+  return writeAll(out->fd, buffer, length);
+}
+
+static int old_pread(const struct bspatch_old* old, void* buffer, int length, int64_t offset)
+{
+  const int fd = *(const int*)old->opaque;
+  uint8_t* p = buffer;
+  ssize_t n;
+
+  while (length > 0)
+  {
+    if ((n = pread(fd, p, length, offset)) <= 0)
+    {
+      if (n < 0 && errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += n;
+    offset += n;
+    length -= n;
+  }
+
+  return 0;
+}
+
+static void old_readahead(const struct bspatch_old* old, int64_t offset, int64_t length)
+{
+  posix_fadvise(*(const int*)old->opaque, offset, length, POSIX_FADV_WILLNEED);
+}
+
+static void streamPatch(const char* oldPath, const char* newPath, const struct stat* sb, int64_t newsize,
+                        struct bspatch_stream* ctrl, struct bspatch_stream* diff, struct bspatch_stream* extra,
+                        const struct bspatch_options* opts, int64_t* skipped)
+{
+  struct bspatch_output output;
+  struct bspatch_old source;
+  struct output out;
+  struct file old;
+  struct stat oldsb, newsb;
+  int64_t oldsize;
+  int oldfd;
+
+  if (sameFile(newPath, sb))
+    errx(1, "%s: cannot patch a pipe or device in place", newPath);
+  if (stat(newPath, &newsb) != 0 || S_ISREG(newsb.st_mode))
+    out.fd = createTemp(newPath, 0666);
+  else if ((out.fd = open(newPath, O_WRONLY, 0)) < 0)
+    err(1, "%s", newPath);
+  if (fstat(out.fd, &newsb) != 0)
+    err(1, "%s", newPath);
+
+  // Only a regular file reads the blocks seeked over as zeros
+  out.skipped = S_ISREG(newsb.st_mode) ? skipped : NULL;
+  output.opaque = &out;
+  output.write = output_write;
+
+  if (S_ISREG(sb->st_mode))
+  {
+    loadFile(oldPath, &old, &oldsb, MADV_WILLNEED, 1);
+    if (bspatch_streaming(old.data, old.size, newsize, ctrl, diff, extra, opts, &output))
+      errx(1, "bspatch");
+    closeFile(oldPath, &old, -1, NULL);
+  }
+  else
+  {
+    if ((oldfd = open(oldPath, O_RDONLY, 0)) < 0 || (oldsize = lseek(oldfd, 0, SEEK_END)) < 0)
+      err(1, "%s", oldPath);
+    source.opaque = &oldfd;
+    source.pread = old_pread;
+    source.readahead = old_readahead;
+    if (bspatch_pread(&source, oldsize, newsize, ctrl, diff, extra, opts, &output))
+      errx(1, "bspatch");
+    close(oldfd);
+  }
+
+  if ((out.skipped != NULL && ftruncate(out.fd, newsize) != 0) || close(out.fd) == -1)
+    err(1, "%s", newPath);
+  if (pendingTemp != NULL)
+    commitTemp(newPath);
+}
+
+/*
+ * In-place patches are applied to the old file itself when it is also the
+ * new file, or else to a temporary copy of it, mapped at max(oldsize,
+ * newsize) bytes.
+ */
+static void patchInPlace(const char* oldPath, const char* newPath, int64_t newsize, struct bspatch_stream* stream,
+                         int64_t* skipped)
+{
+  struct file old;
   struct stat sb;
+  uint8_t* map = NULL;
+  int64_t size, copied = 0;
+  int fd;
 
-  if (argc != 4)
-    errx(1, "usage: %s oldfile newfile patchfile\n", argv[0]);
+  if (stat(oldPath, &sb) != 0)
+    err(1, "%s", oldPath);
+  if (sameFile(newPath, &sb))
+  {
+    if ((fd = open(newPath, O_RDWR, 0)) < 0)
+      err(1, "%s", newPath);
+  }
+  else
+  {
+    loadFile(oldPath, &old, &sb, MADV_SEQUENTIAL, 1);
+    fd = createTemp(newPath, sb.st_mode);
+    if ((skipped == NULL) ? writeAll(fd, old.data, old.size) : writeSparse(fd, old.data, old.size, &copied))
+      err(1, "%s", newPath);
+    closeFile(oldPath, &old, -1, NULL);
+  }
 
-  /* Open patch file */
-  if ((f = fopen(argv[3], "r")) == NULL)
-    err(1, "fopen(%s)", argv[3]);
+  // A sparse file is not allocated, only the blocks patched are
+  size = (sb.st_size > newsize) ? sb.st_size : newsize;
+  if (size > 0)
+  {
+    if (ftruncate(fd, size) != 0 || (skipped == NULL && posix_fallocate(fd, 0, size) != 0))
+      errx(1, "%s: could not allocate %lld bytes", newPath, (long long)size);
+    if ((map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+      err(1, "mmap(%s)", newPath);
+    madvise(map, size, MADV_WILLNEED);
+  }
 
-  /* Read header */
-  if (fread(header, 1, 24, f) != 24)
+  if (bspatch_inplace(map, sb.st_size, newsize, stream))
+    errx(1, "bspatch");
+  if (skipped != NULL)
+    punchHoles(fd, map, newsize, skipped);
+
+  if ((map != NULL && munmap(map, size) != 0) || ftruncate(fd, newsize) != 0 || close(fd) == -1)
+    err(1, "%s", newPath);
+  if (pendingTemp != NULL)
+    commitTemp(newPath);
+}
+
+int main(int argc, char* argv[])
 {
-    if (feof(f))
-      errx(1, "Corrupt patch\n");
-    err(1, "fread(%s)", argv[3]);
+  struct file old, new, patch;
+  struct stat sb, newsb, patchsb;
+  int fd;
+  uint8_t* header;
+  int64_t newsize;
+  int64_t offset[4];
+  int codec, framed;
+  struct codec_reader* reader[3];
+  struct codec_frame_reader* frames[3];
+  struct threadpool* pool = NULL;
+  struct bspatch_stream stream[3];
+  int channels, k, opt;
+  struct bspatch_options opts;
+  int threads = 1;
+  int64_t holes = 0;
+  int64_t* skipped = NULL;
+  int streamed, inplace = 0;
+
+  while ((opt = getopt(argc, argv, "j:S")) != -1)
+  {
+    if (opt == 'S')
+      skipped = &holes;
+    else if (opt != 'j' || (threads = atoi(optarg)) < 1)
+      errx(1, "usage: %s [-j threads] [-S] oldfile newfile patchfile\n", argv[0]);
   }
+  if (argc - optind != 3)
+    errx(1, "usage: %s [-j threads] [-S] oldfile newfile patchfile\n", argv[0]);
+  argv += optind - 1;
+
+  bspatch_options_init(&opts);
 
-  /* Check for appropriate magic */
-  if (memcmp(header, "ENDSLEY/BSDIFF43", 16) != 0)
+  /* Map the patch file, each channel is read front to back */
+  if (stat(argv[3], &patchsb) != 0)
+    err(1, "%s", argv[3]);
+  loadFile(argv[3], &patch, &patchsb, MADV_SEQUENTIAL, !sameFile(argv[2], &patchsb));
+  header = patch.data;
+
+  /*
+   * ENDSLEY/BSDIFF43: newsize, then a single bzip2 stream
+   * ENDSLEY/BSDIFF44: codec id, level and flags, 5 zero bytes, newsize, ctrl
+   * and diff sizes, then a compressed stream for each of ctrl, diff and
+   * extra, framed when bit 0 of the flags is set
+   * ENDSLEY/BSDIFF45: the same with varint control records, or with
+   * bit 1 of the flags, an in-place patch in the ctrl channel
+   */
+  if (patch.size >= 24 && memcmp(header, "ENDSLEY/BSDIFF43", 16) == 0)
+  {
+    channels = 1;
+    codec = CODEC_BZIP2;
+    framed = 0;
+    newsize = offtin(header + 16);
+    offset[0] = 24;
+  }
+  else if (patch.size >= 48 && (memcmp(header, "ENDSLEY/BSDIFF44", 16) == 0 || memcmp(header, "ENDSLEY/BSDIFF45", 16) == 0))
+  {
+    channels = 3;
+    codec = header[16];
+    framed = header[18] & 0x01;
+    inplace = header[18] & 0x02;
+    if (header[15] == '5')
+      opts.ctrl_format = BSPATCH_CTRL_VARINT;
+    newsize = offtin(header + 24);
+    offset[0] = 48;
+    offset[1] = offtin(header + 32);
+    offset[2] = offtin(header + 40);
+    if (offset[1] < 0 || offset[2] < 0 || offset[1] > patch.size || offset[2] > patch.size)
+      errx(1, "Corrupt patch\n");
+    offset[1] += offset[0];
+    offset[2] += offset[1];
+  }
+  else
     errx(1, "Corrupt patch\n");
+  offset[channels] = patch.size;
 
-  /* Read lengths from header */
-  newsize = offtin(header + 16);
-  if (newsize < 0)
+  if (newsize < 0 || offset[channels - 1] > patch.size || codec_info(codec) == NULL)
     errx(1, "Corrupt patch\n");
+  if (!codec_info(codec)->available)
+    errx(1, "This bspatch was built without %s", codec_info(codec)->name);
 
-  /* Close patch file and re-open it via libbzip2 at the right places */
-  if (((fd = open(argv[1], O_RDONLY, 0)) < 0) || ((oldsize = lseek(fd, 0, SEEK_END)) == -1) || ((old = malloc(oldsize + 1)) == NULL) || (lseek(fd, 0, SEEK_SET) != 0) || (read(fd, old, oldsize) != oldsize) || (fstat(fd, &sb)) || (close(fd) == -1))
-    err(1, "%s", argv[1]);
-  if ((new = malloc(newsize + 1)) == NULL)
-    err(1, NULL);
+  /* Frames are decompressed ahead by the other threads */
+  if (framed && threads > 1 && (pool = threadpool_create(threads)) == NULL)
+    err(1, "threadpool_create");
 
-  if (NULL == (bz2 = BZ2_bzReadOpen(&bz2err, f, 0, 0, NULL, 0)))
-    errx(1, "BZ2_bzReadOpen, bz2err=%d", bz2err);
+  for (k = 0; k < channels; k++)
+  {
+    const uint8_t* data = patch.data + offset[k];
+    const size_t size = offset[k + 1] - offset[k];
 
-  stream.read = bz2_read;
-  stream.opaque = bz2;
-  if (bspatch(old, oldsize, new, newsize, &stream))
-    errx(1, "bspatch");
+    if (framed)
+    {
+      if (NULL == (frames[k] = codec_frame_reader_open(data, size, pool)))
+        errx(1, "Corrupt patch\n");
+      stream[k].read = codec_frame_stream_read;
+      stream[k].opaque = frames[k];
+      continue;
+    }
+    if (NULL == (reader[k] = codec_reader_open_mem(codec, data, size)))
+      errx(1, "Could not start %s decompression", codec_info(codec)->name);
+    stream[k].read = codec_stream_read;
+    stream[k].opaque = reader[k];
+  }
+
+  if (inplace)
+  {
+    patchInPlace(argv[1], argv[2], newsize, &stream[0], skipped);
+    reportSparse(argv[2], skipped);
+    return 0;
+  }
 
-  /* Clean up the bzip2 reads */
-  BZ2_bzReadClose(&bz2err, bz2);
-  fclose(f);
+  if (stat(argv[1], &sb) != 0)
+    err(1, "%s", argv[1]);
+  streamed = !S_ISREG(sb.st_mode) || (stat(argv[2], &newsb) == 0 && !S_ISREG(newsb.st_mode));
+  if (streamed)
+    streamPatch(argv[1], argv[2], &sb, newsize, &stream[0], &stream[channels == 3 ? 1 : 0],
+                &stream[channels == 3 ? 2 : 0], &opts, skipped);
+  else
+  {
+    /* Map the old file, which stays valid when the new file is renamed
+     * over it. Most of it gets read, in an order only the patch knows. */
+    loadFile(argv[1], &old, &sb, MADV_WILLNEED, 1);
+    fd = createFile(argv[2], &new, newsize, sb.st_mode, skipped != NULL);
 
-  /* Write the new file */
-  if (((fd = open(argv[2], O_CREAT | O_TRUNC | O_WRONLY, sb.st_mode)) < 0) || (write(fd, new, newsize) != newsize) || (close(fd) == -1))
-    err(1, "%s", argv[2]);
+    if ((channels == 1 && bspatch(old.data, old.size, new.data, newsize, &stream[0])) ||
+        (channels == 3 && bspatch_channels_ex(old.data, old.size, new.data, newsize, &stream[0], &stream[1], &stream[2], &opts)))
+      errx(1, "bspatch");
+  }
 
-  free(new);
-  free(old);
+  /* Clean up the reads */
+  for (k = 0; k < channels; k++)
+  {
+    if (framed)
+      codec_frame_reader_close(frames[k]);
+    else
+      codec_reader_close(reader[k]);
+  }
+  threadpool_destroy(pool);
+
+  /* Write the new file, if it was not written in place */
+  if (!streamed)
+  {
+    closeFile(argv[2], &new, fd, skipped);
+    commitTemp(argv[2]);
+    closeFile(argv[1], &old, -1, NULL);
+  }
+  closeFile(argv[3], &patch, -1, NULL);
+  reportSparse(argv[2], skipped);
 
   return 0;
 }
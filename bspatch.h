@@ -28,6 +28,7 @@
 #ifndef BSPATCH_H
 # define BSPATCH_H
 
+# include <stddef.h>
 # include <stdint.h>
 
 struct bspatch_stream
@@ -36,7 +37,99 @@ struct bspatch_stream
     int (*read)(const struct bspatch_stream* stream, void* buffer, int length);
 };
 
+/* Where bspatch_streaming() hands new over, in order */
+struct bspatch_output
+{
+  void* opaque;
+  int (*write)(const struct bspatch_output* output, const void* buffer, int length);
+};
+
+/* Where bspatch_pread() reads old from. pread() reads length bytes at
+ * offset and returns 0 on success. readahead() is told about the parts of
+ * old that are read next, in order, and may be NULL. */
+struct bspatch_old
+{
+  void* opaque;
+  int (*pread)(const struct bspatch_old* old, void* buffer, int length, int64_t offset);
+  void (*readahead)(const struct bspatch_old* old, int64_t offset, int64_t length);
+};
+
+/* Encoding of control records, as in bsdiff_options */
+enum bspatch_ctrl_format
+{
+  BSPATCH_CTRL_FIXED = 0,
+  BSPATCH_CTRL_VARINT
+};
+
+struct bspatch_options
+{
+  enum bspatch_ctrl_format ctrl_format;
+  /* Bytes of old cached by bspatch_pread(), 4 MiB by default */
+  size_t cache_size;
+};
+
+/* Fill opts with the default settings, used by bspatch() */
+void bspatch_options_init(struct bspatch_options* opts);
+
+/* Apply a patch written to a single stream by bsdiff() */
 int bspatch(const uint8_t* old, int64_t oldsize, uint8_t* new, int64_t newsize, struct bspatch_stream* stream);
 
+/* Apply a patch written to three streams by bsdiff_channels(). A stream
+ * passed more than once is read in order, as bsdiff_channels() wrote it. */
+int bspatch_channels(const uint8_t* old, int64_t oldsize, uint8_t* new, int64_t newsize,
+                     struct bspatch_stream* ctrl, struct bspatch_stream* diff, struct bspatch_stream* extra);
+int bspatch_channels_ex(const uint8_t* old, int64_t oldsize, uint8_t* new, int64_t newsize,
+                        struct bspatch_stream* ctrl, struct bspatch_stream* diff, struct bspatch_stream* extra,
+                        const struct bspatch_options* opts);
+
+/* Apply a patch written by bsdiff_channels() like bspatch_channels_ex(),
+ * but hand new to output in blocks of 64 KiB (the last one may be shorter)
+ * instead of writing it to memory. Apply a patch written by bsdiff() by
+ * passing its stream three times. */
+int bspatch_streaming(const uint8_t* old, int64_t oldsize, int64_t newsize,
+                      struct bspatch_stream* ctrl, struct bspatch_stream* diff, struct bspatch_stream* extra,
+                      const struct bspatch_options* opts, const struct bspatch_output* output);
+
+/* Like bspatch_streaming(), but read old through old instead of memory,
+ * keeping opts->cache_size bytes of it in 64 KiB blocks. When ctrl is a
+ * stream of its own, control records are read ahead to plan readahead(). */
+int bspatch_pread(const struct bspatch_old* old, int64_t oldsize, int64_t newsize,
+                  struct bspatch_stream* ctrl, struct bspatch_stream* diff, struct bspatch_stream* extra,
+                  const struct bspatch_options* opts, const struct bspatch_output* output);
+
+/* State of an incremental bspatch, see bspatch_init(). Its fields are
+ * private. */
+struct bspatch_ctx
+{
+  const uint8_t* old;
+  int64_t oldsize;
+  uint8_t* new;
+  int64_t newsize;
+  const struct bspatch_output* output;
+  int varint;
+  int stage;
+  int64_t oldpos, newpos, left;
+  int64_t ctrl[3];
+  uint8_t pending[32];
+  int have, need;
+};
+
+/* Apply a patch written to a single stream by bsdiff() or bsdiff_ex()
+ * incrementally, for callers that cannot block on bspatch_stream reads.
+ * new is written to new when it is not NULL, else handed to output in order.
+ * bspatch_feed() takes the next length bytes of the patch, however many
+ * there are, and bspatch_finish() tells whether the whole patch was fed.
+ * All of them return 0 on success and -1 on failure; after a failure, ctx
+ * only fails. ctx needs no cleanup. */
+int bspatch_init(struct bspatch_ctx* ctx, const uint8_t* old, int64_t oldsize, uint8_t* new, int64_t newsize,
+                 const struct bspatch_options* opts, const struct bspatch_output* output);
+int bspatch_feed(struct bspatch_ctx* ctx, const void* buffer, size_t length);
+int bspatch_finish(struct bspatch_ctx* ctx);
+
+/* Apply a patch written by bsdiff_inplace(). buffer holds the oldsize bytes
+ * of old and must be at least max(oldsize, newsize) bytes long. On success,
+ * it starts with the newsize bytes of new. */
+int bspatch_inplace(uint8_t* buffer, int64_t oldsize, int64_t newsize, struct bspatch_stream* stream);
+
 #endif
 
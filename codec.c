@@ -0,0 +1,1151 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "codec.h"
+#include "threadpool.h"
+
+#include <bzlib.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(WITH_ZSTD)
+# include <zstd.h>
+#endif
+#if defined(WITH_LZ4)
+# include <lz4frame.h>
+#endif
+
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+
+#define CODEC_BUFFER_SIZE (1 << 16)
+
+struct codec_ops;
+
+struct codec_writer
+{
+  const struct codec_ops* ops;
+  FILE* f;
+  void* state;
+  uint8_t* buffer; // Compressed data on its way to f, if the codec needs it
+  size_t capacity;
+};
+
+struct codec_reader
+{
+  const struct codec_ops* ops;
+  FILE* f;         // NULL when reading from memory
+  void* state;
+  uint8_t* buffer; // Compressed data read from f, if the codec needs it
+  size_t capacity;
+  const uint8_t* in; // in[pos, len) is the compressed data not consumed yet
+  size_t pos;
+  size_t len;
+  int eof;         // Nothing more to read from f, or from memory
+  int end;         // The compressed stream is over
+};
+
+struct codec_ops
+{
+  int (*writer_open)(struct codec_writer* w, int level);
+  int (*write)(struct codec_writer* w, const uint8_t* p, size_t size);
+  int (*writer_close)(struct codec_writer* w); // Also releases the state, even on failure
+  int (*reader_open)(struct codec_reader* r);
+  // Returns the number of bytes read, less than size only at the end of
+  // the stream, or -1 on failure
+  int64_t (*read)(struct codec_reader* r, uint8_t* p, size_t size);
+  void (*reader_close)(struct codec_reader* r);
+};
+
+static int write_all(FILE* f, const void* p, size_t size)
+{
+  return (size > 0 && fwrite(p, 1, size, f) != size) ? -1 : 0;
+}
+
+// Refill the input buffer once it has been consumed. Memory readers get
+// all of their input at once.
+static void reader_fill(struct codec_reader* r)
+{
+  if (r->pos == r->len && !r->eof)
+  {
+    r->in = r->buffer;
+    r->pos = 0;
+    r->len = fread(r->buffer, 1, r->capacity, r->f);
+    if (r->len == 0)
+      r->eof = 1;
+  }
+}
+
+// Input buffer for the codecs that need one, not for memory readers
+static int reader_buffer(struct codec_reader* r, size_t capacity)
+{
+  if (r->f == NULL)
+    return 0;
+
+  r->capacity = capacity;
+  r->buffer = malloc(capacity);
+  return (r->buffer != NULL) ? 0 : -1;
+}
+
+/* Store */
+
+static int store_writer_open(struct codec_writer* w, int level)
+{
+  (void)w;
+  (void)level;
+  return 0;
+}
+
+static int store_write(struct codec_writer* w, const uint8_t* p, size_t size)
+{
+  return write_all(w->f, p, size);
+}
+
+static int store_writer_close(struct codec_writer* w)
+{
+  (void)w;
+  return 0;
+}
+
+static int store_reader_open(struct codec_reader* r)
+{
+  (void)r;
+  return 0;
+}
+
+static int64_t store_read(struct codec_reader* r, uint8_t* p, size_t size)
+{
+  size_t n;
+
+  if (r->f == NULL)
+  {
+    n = MIN(size, r->len - r->pos);
+    memcpy(p, r->in + r->pos, n);
+    r->pos += n;
+    return (int64_t)n;
+  }
+
+  n = fread(p, 1, size, r->f);
+  return (n < size && ferror(r->f)) ? -1 : (int64_t)n;
+}
+
+static void store_reader_close(struct codec_reader* r)
+{
+  (void)r;
+}
+
+static const struct codec_ops store_ops =
+{
+  store_writer_open, store_write, store_writer_close,
+  store_reader_open, store_read, store_reader_close
+};
+
+/* bzip2 */
+
+static int bzip2_writer_open(struct codec_writer* w, int level)
+{
+  int bz2err;
+
+  w->state = BZ2_bzWriteOpen(&bz2err, w->f, level, 0, 0);
+  return (w->state != NULL) ? 0 : -1;
+}
+
+static int bzip2_write(struct codec_writer* w, const uint8_t* p, size_t size)
+{
+  int bz2err;
+
+  while (size > 0)
+  {
+    const int n = (int)MIN(size, INT_MAX);
+    BZ2_bzWrite(&bz2err, w->state, (void*)p, n);
+    if (bz2err != BZ_OK)
+      return -1;
+    p += n;
+    size -= n;
+  }
+
+  return 0;
+}
+
+static int bzip2_writer_close(struct codec_writer* w)
+{
+  int bz2err;
+
+  BZ2_bzWriteClose(&bz2err, w->state, 0, NULL, NULL);
+  return (bz2err == BZ_OK) ? 0 : -1;
+}
+
+// Through the low-level interface, which can also decompress from memory
+static int bzip2_reader_open(struct codec_reader* r)
+{
+  bz_stream* bz = calloc(1, sizeof(*bz));
+
+  if (bz == NULL)
+    return -1;
+  if (BZ2_bzDecompressInit(bz, 0, 0) != BZ_OK)
+  {
+    free(bz);
+    return -1;
+  }
+  r->state = bz;
+
+  if (reader_buffer(r, CODEC_BUFFER_SIZE))
+  {
+    BZ2_bzDecompressEnd(bz);
+    free(bz);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int64_t bzip2_read(struct codec_reader* r, uint8_t* p, size_t size)
+{
+  bz_stream* bz = r->state;
+  size_t total = 0;
+
+  while (total < size && !r->end)
+  {
+    size_t consumed, produced;
+    int ret;
+
+    reader_fill(r);
+    bz->next_in = (char*)r->in + r->pos;
+    bz->avail_in = (unsigned int)MIN(r->len - r->pos, UINT_MAX);
+    bz->next_out = (char*)p + total;
+    bz->avail_out = (unsigned int)MIN(size - total, UINT_MAX);
+    consumed = bz->avail_in;
+    produced = bz->avail_out;
+
+    ret = BZ2_bzDecompress(bz);
+    if (ret != BZ_OK && ret != BZ_STREAM_END)
+      return -1;
+    consumed -= bz->avail_in;
+    produced -= bz->avail_out;
+    r->pos += consumed;
+    total += produced;
+
+    if (ret == BZ_STREAM_END)
+      r->end = 1;
+    // Truncated stream
+    else if (r->eof && consumed == 0 && produced == 0)
+      break;
+  }
+
+  return (int64_t)total;
+}
+
+static void bzip2_reader_close(struct codec_reader* r)
+{
+  BZ2_bzDecompressEnd(r->state);
+  free(r->state);
+}
+
+static const struct codec_ops bzip2_ops =
+{
+  bzip2_writer_open, bzip2_write, bzip2_writer_close,
+  bzip2_reader_open, bzip2_read, bzip2_reader_close
+};
+
+/* zstd */
+
+#if defined(WITH_ZSTD)
+static int zstd_writer_open(struct codec_writer* w, int level)
+{
+  ZSTD_CCtx* cctx = ZSTD_createCCtx();
+
+  if (cctx == NULL)
+    return -1;
+  w->state = cctx;
+
+  // Long distance matching finds the repeats across the whole channel,
+  // which is what diff data is made of
+  if (ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level)) ||
+      ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_enableLongDistanceMatching, 1)))
+  {
+    ZSTD_freeCCtx(cctx);
+    return -1;
+  }
+
+  w->capacity = ZSTD_CStreamOutSize();
+  if ((w->buffer = malloc(w->capacity)) == NULL)
+  {
+    ZSTD_freeCCtx(cctx);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int zstd_compress(struct codec_writer* w, ZSTD_inBuffer* in, ZSTD_EndDirective mode)
+{
+  size_t remaining;
+
+  do
+  {
+    ZSTD_outBuffer out = { w->buffer, w->capacity, 0 };
+    remaining = ZSTD_compressStream2(w->state, &out, in, mode);
+    if (ZSTD_isError(remaining) || write_all(w->f, w->buffer, out.pos))
+      return -1;
+  }
+  while ((mode == ZSTD_e_end) ? (remaining != 0) : (in->pos < in->size));
+
+  return 0;
+}
+
+static int zstd_write(struct codec_writer* w, const uint8_t* p, size_t size)
+{
+  ZSTD_inBuffer in = { p, size, 0 };
+
+  return zstd_compress(w, &in, ZSTD_e_continue);
+}
+
+static int zstd_writer_close(struct codec_writer* w)
+{
+  ZSTD_inBuffer in = { NULL, 0, 0 };
+  const int result = zstd_compress(w, &in, ZSTD_e_end);
+
+  ZSTD_freeCCtx(w->state);
+  return result;
+}
+
+static int zstd_reader_open(struct codec_reader* r)
+{
+  if ((r->state = ZSTD_createDCtx()) == NULL)
+    return -1;
+
+  if (reader_buffer(r, ZSTD_DStreamInSize()))
+  {
+    ZSTD_freeDCtx(r->state);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int64_t zstd_read(struct codec_reader* r, uint8_t* p, size_t size)
+{
+  ZSTD_outBuffer out = { p, size, 0 };
+
+  while (out.pos < out.size)
+  {
+    const size_t before = out.pos;
+    ZSTD_inBuffer in;
+
+    reader_fill(r);
+    in.src = r->in;
+    in.size = r->len;
+    in.pos = r->pos;
+    if (ZSTD_isError(ZSTD_decompressStream(r->state, &out, &in)))
+      return -1;
+    r->pos = in.pos;
+
+    // Past the end of the input, stop once nothing is left to flush
+    if (r->eof && out.pos == before)
+      break;
+  }
+
+  return (int64_t)out.pos;
+}
+
+static void zstd_reader_close(struct codec_reader* r)
+{
+  ZSTD_freeDCtx(r->state);
+}
+
+static const struct codec_ops zstd_ops =
+{
+  zstd_writer_open, zstd_write, zstd_writer_close,
+  zstd_reader_open, zstd_read, zstd_reader_close
+};
+#endif
+
+/* lz4 */
+
+#if defined(WITH_LZ4)
+struct lz4_writer
+{
+  LZ4F_cctx* cctx;
+  LZ4F_preferences_t prefs;
+};
+
+static int lz4_writer_open(struct codec_writer* w, int level)
+{
+  struct lz4_writer* lz4 = calloc(1, sizeof(*lz4));
+  size_t n;
+
+  if (lz4 == NULL)
+    return -1;
+  w->state = lz4;
+
+  lz4->prefs.compressionLevel = level;
+  lz4->prefs.frameInfo.blockSizeID = LZ4F_max4MB;
+  w->capacity = LZ4F_compressBound(CODEC_BUFFER_SIZE, &lz4->prefs);
+  if (LZ4F_isError(LZ4F_createCompressionContext(&lz4->cctx, LZ4F_VERSION)))
+  {
+    free(lz4);
+    return -1;
+  }
+  if ((w->buffer = malloc(w->capacity)) == NULL)
+  {
+    LZ4F_freeCompressionContext(lz4->cctx);
+    free(lz4);
+    return -1;
+  }
+
+  // The frame header
+  n = LZ4F_compressBegin(lz4->cctx, w->buffer, w->capacity, &lz4->prefs);
+  if (LZ4F_isError(n) || write_all(w->f, w->buffer, n))
+  {
+    LZ4F_freeCompressionContext(lz4->cctx);
+    free(lz4);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int lz4_write(struct codec_writer* w, const uint8_t* p, size_t size)
+{
+  struct lz4_writer* lz4 = w->state;
+
+  // w->capacity is only enough for CODEC_BUFFER_SIZE bytes at a time
+  while (size > 0)
+  {
+    const size_t chunk = MIN(size, CODEC_BUFFER_SIZE);
+    const size_t n = LZ4F_compressUpdate(lz4->cctx, w->buffer, w->capacity, p, chunk, NULL);
+    if (LZ4F_isError(n) || write_all(w->f, w->buffer, n))
+      return -1;
+    p += chunk;
+    size -= chunk;
+  }
+
+  return 0;
+}
+
+static int lz4_writer_close(struct codec_writer* w)
+{
+  struct lz4_writer* lz4 = w->state;
+  const size_t n = LZ4F_compressEnd(lz4->cctx, w->buffer, w->capacity, NULL);
+  const int result = (LZ4F_isError(n) || write_all(w->f, w->buffer, n)) ? -1 : 0;
+
+  LZ4F_freeCompressionContext(lz4->cctx);
+  free(lz4);
+  return result;
+}
+
+static int lz4_reader_open(struct codec_reader* r)
+{
+  LZ4F_dctx* dctx;
+
+  if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+    return -1;
+  r->state = dctx;
+
+  if (reader_buffer(r, CODEC_BUFFER_SIZE))
+  {
+    LZ4F_freeDecompressionContext(dctx);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int64_t lz4_read(struct codec_reader* r, uint8_t* p, size_t size)
+{
+  size_t total = 0;
+
+  while (total < size)
+  {
+    size_t dstSize = size - total;
+    size_t srcSize;
+
+    reader_fill(r);
+    srcSize = r->len - r->pos;
+    if (LZ4F_isError(LZ4F_decompress(r->state, p + total, &dstSize, r->in + r->pos, &srcSize, NULL)))
+      return -1;
+    r->pos += srcSize;
+    total += dstSize;
+
+    // Past the end of the input, stop once nothing is left to flush
+    if (r->eof && dstSize == 0)
+      break;
+  }
+
+  return (int64_t)total;
+}
+
+static void lz4_reader_close(struct codec_reader* r)
+{
+  LZ4F_freeDecompressionContext(r->state);
+}
+
+static const struct codec_ops lz4_ops =
+{
+  lz4_writer_open, lz4_write, lz4_writer_close,
+  lz4_reader_open, lz4_read, lz4_reader_close
+};
+#endif
+
+/* Codecs */
+
+#if defined(WITH_ZSTD)
+# define ZSTD_OPS &zstd_ops
+# define HAVE_ZSTD 1
+#else
+# define ZSTD_OPS NULL
+# define HAVE_ZSTD 0
+#endif
+#if defined(WITH_LZ4)
+# define LZ4_OPS &lz4_ops
+# define HAVE_LZ4 1
+#else
+# define LZ4_OPS NULL
+# define HAVE_LZ4 0
+#endif
+
+static const struct codec_info codecs[CODEC_COUNT] =
+{
+  [CODEC_STORE] = { "store", 1, 0, 0, 0 },
+  [CODEC_BZIP2] = { "bzip2", 1, 1, 9, 9 },
+  [CODEC_ZSTD]  = { "zstd", HAVE_ZSTD, 1, 22, 19 },
+  [CODEC_LZ4]   = { "lz4", HAVE_LZ4, 0, 12, 9 },
+};
+
+static const struct codec_ops* const codec_ops[CODEC_COUNT] =
+{
+  [CODEC_STORE] = &store_ops,
+  [CODEC_BZIP2] = &bzip2_ops,
+  [CODEC_ZSTD]  = ZSTD_OPS,
+  [CODEC_LZ4]   = LZ4_OPS,
+};
+
+const struct codec_info* codec_info(int id)
+{
+  return (id >= 0 && id < CODEC_COUNT) ? &codecs[id] : NULL;
+}
+
+int codec_find(const char* name)
+{
+  int id;
+
+  for (id = 0; id < CODEC_COUNT; id++)
+    if (strcmp(codecs[id].name, name) == 0)
+      return id;
+
+  return -1;
+}
+
+struct codec_writer* codec_writer_open(int id, int level, FILE* f)
+{
+  const struct codec_info* info = codec_info(id);
+  struct codec_writer* w;
+
+  if (info == NULL || !info->available || level < info->min_level || level > info->max_level)
+    return NULL;
+  if ((w = calloc(1, sizeof(*w))) == NULL)
+    return NULL;
+
+  w->ops = codec_ops[id];
+  w->f = f;
+  if (w->ops->writer_open(w, level))
+  {
+    free(w->buffer);
+    free(w);
+    return NULL;
+  }
+
+  return w;
+}
+
+int codec_write(struct codec_writer* w, const void* buffer, size_t size)
+{
+  return w->ops->write(w, buffer, size);
+}
+
+int codec_writer_close(struct codec_writer* w)
+{
+  int result = w->ops->writer_close(w);
+
+  if (fflush(w->f) != 0)
+    result = -1;
+  free(w->buffer);
+  free(w);
+  return result;
+}
+
+static struct codec_reader* reader_open(int id, FILE* f, const void* data, size_t size)
+{
+  const struct codec_info* info = codec_info(id);
+  struct codec_reader* r;
+
+  if (info == NULL || !info->available)
+    return NULL;
+  if ((r = calloc(1, sizeof(*r))) == NULL)
+    return NULL;
+
+  r->ops = codec_ops[id];
+  r->f = f;
+  if (f == NULL)
+  {
+    r->in = data;
+    r->len = size;
+    r->eof = 1;
+  }
+  if (r->ops->reader_open(r))
+  {
+    free(r->buffer);
+    free(r);
+    return NULL;
+  }
+
+  return r;
+}
+
+struct codec_reader* codec_reader_open(int id, FILE* f)
+{
+  return reader_open(id, f, NULL, 0);
+}
+
+struct codec_reader* codec_reader_open_mem(int id, const void* data, size_t size)
+{
+  return reader_open(id, NULL, data, size);
+}
+
+int codec_read(struct codec_reader* r, void* buffer, size_t size)
+{
+  return (r->ops->read(r, buffer, size) == (int64_t)size) ? 0 : -1;
+}
+
+void codec_reader_close(struct codec_reader* r)
+{
+  r->ops->reader_close(r);
+  free(r->buffer);
+  free(r);
+}
+
+/* Frames */
+
+// Frames in flight per thread, on both sides
+#define FRAMES_AHEAD 2
+
+// Frames whose sampled entropy (bits per byte) reaches these are stored, or
+// compressed with the fast codec
+#define STORE_ENTROPY 7.9
+#define FAST_ENTROPY 7.5
+#define SAMPLE_CHUNK 4096
+#define SAMPLE_CHUNKS 16
+
+enum frame_state
+{
+  FRAME_QUEUED,
+  FRAME_RUNNING,
+  FRAME_DONE
+};
+
+struct codec_frame
+{
+  const struct codec_frame_writer* writer;
+  uint8_t* raw;   // Decompressed data
+  size_t rawsize;
+  char* data;     // Codec tag, then the compressed data (writers only, until flushed)
+  const uint8_t* in;  // The same, in the memory of readers
+  size_t size;
+  const uint8_t* out; // Where the decompressed data is, raw or data when stored
+  int state;      // See frame_state, only used by readers
+  int status;
+};
+
+static void put64(uint64_t x, uint8_t* buf)
+{
+  int i;
+
+  for (i = 0; i < 8; i++, x >>= 8)
+    buf[i] = x & 0xff;
+}
+
+static uint64_t get64(const uint8_t* buf)
+{
+  uint64_t x = 0;
+  int i;
+
+  for (i = 7; i >= 0; i--)
+    x = (x << 8) | buf[i];
+
+  return x;
+}
+
+static void free_frame(struct codec_frame* frame)
+{
+  if (frame != NULL)
+  {
+    free(frame->raw);
+    free(frame->data);
+    free(frame);
+  }
+}
+
+struct codec_frame_writer
+{
+  int id;
+  int level;
+  int fast_id;
+  size_t frame_size;
+  struct threadpool* pool;
+  FILE* out;     // Where the frames go, in order, as soon as they are done
+  struct codec_frame** frames;
+  size_t count;
+  size_t capacity;
+  size_t waited; // Frames known to be compressed
+  size_t flushed; // Frames written to out, only their sizes are kept
+  int status;
+  uint8_t* current;
+  size_t used;
+};
+
+// Order-0 entropy of a sample of data, in bits per byte
+static double sample_entropy(const uint8_t* data, size_t size)
+{
+  size_t counts[256] = { 0 };
+  size_t total = 0;
+  double entropy = 0;
+  size_t k, i;
+
+  // Spread the sample over the whole frame
+  for (k = 0; k < SAMPLE_CHUNKS; k++)
+  {
+    const size_t start = (size > SAMPLE_CHUNK) ? (size - SAMPLE_CHUNK) / (SAMPLE_CHUNKS - 1) * k : 0;
+    const size_t end = MIN(size, start + SAMPLE_CHUNK);
+    for (i = start; i < end; i++)
+      counts[data[i]]++;
+    total += end - start;
+    if (size <= SAMPLE_CHUNK)
+      break;
+  }
+
+  for (i = 0; i < 256; i++)
+    if (counts[i] > 0)
+      entropy -= (double)counts[i] / total * log2((double)counts[i] / total);
+
+  return entropy;
+}
+
+static int compress_with(struct codec_frame* frame, int id, int level)
+{
+  FILE* m = open_memstream(&frame->data, &frame->size);
+  struct codec_writer* w;
+  int result = -1;
+
+  if (m == NULL)
+    return -1;
+  if (fputc(id, m) != EOF && (w = codec_writer_open(id, level, m)) != NULL)
+  {
+    result = codec_write(w, frame->raw, frame->rawsize);
+    if (codec_writer_close(w))
+      result = -1;
+  }
+  if (fclose(m) != 0)
+    result = -1;
+
+  return result;
+}
+
+// Pick a codec for frame->raw and compress it into frame->data, on any thread
+static void compress_frame(void* ctx, int64_t unused_a, int64_t unused_b)
+{
+  struct codec_frame* frame = ctx;
+  const struct codec_frame_writer* w = frame->writer;
+  const double entropy = sample_entropy(frame->raw, frame->rawsize);
+  int id = w->id;
+  int level = w->level;
+
+  (void)unused_a;
+  (void)unused_b;
+
+  if (entropy >= STORE_ENTROPY)
+    id = CODEC_STORE;
+  else if (entropy >= FAST_ENTROPY && w->fast_id >= 0)
+  {
+    id = w->fast_id;
+    level = codec_info(id)->min_level;
+  }
+
+  frame->status = (id != CODEC_STORE) ? compress_with(frame, id, level) : -1;
+
+  // Also stores what the sample missed
+  if (frame->status != 0 || frame->size > frame->rawsize)
+  {
+    free(frame->data);
+    frame->data = malloc(frame->rawsize + 1);
+    frame->size = frame->rawsize + 1;
+    frame->status = -1;
+    if (frame->data != NULL)
+    {
+      frame->data[0] = CODEC_STORE;
+      memcpy(frame->data + 1, frame->raw, frame->rawsize);
+      frame->status = 0;
+    }
+  }
+
+  free(frame->raw);
+  frame->raw = NULL;
+}
+
+// Write the compressed frames before end to out and free their data
+static void flush_frames(struct codec_frame_writer* w, size_t end)
+{
+  for (; w->flushed < end; w->flushed++)
+  {
+    struct codec_frame* frame = w->frames[w->flushed];
+    if (frame->status != 0 || (w->status == 0 && write_all(w->out, frame->data, frame->size)))
+      w->status = -1;
+    free(frame->data);
+    frame->data = NULL;
+  }
+}
+
+// Hand the current frame over for compression
+static int submit_frame(struct codec_frame_writer* w)
+{
+  struct codec_frame* frame;
+
+  if (w->count == w->capacity)
+  {
+    const size_t capacity = w->capacity ? w->capacity * 2 : 64;
+    struct codec_frame** frames = realloc(w->frames, capacity * sizeof(*frames));
+    if (frames == NULL)
+      return -1;
+    w->frames = frames;
+    w->capacity = capacity;
+  }
+  if ((frame = calloc(1, sizeof(*frame))) == NULL)
+    return -1;
+
+  frame->writer = w;
+  frame->raw = w->current;
+  frame->rawsize = w->used;
+  w->frames[w->count++] = frame;
+  w->current = NULL;
+  w->used = 0;
+
+  if (w->pool == NULL)
+  {
+    compress_frame(frame, 0, 0);
+    flush_frames(w, w->count);
+    return w->status;
+  }
+
+  // Bound the memory held by frames waiting for a thread or for their turn
+  // to be written
+  if (w->count - w->waited > (size_t)threadpool_threads(w->pool) * FRAMES_AHEAD)
+  {
+    threadpool_wait(w->pool);
+    w->waited = w->count - 1;
+    flush_frames(w, w->waited);
+    if (w->status)
+      return -1;
+  }
+  threadpool_submit(w->pool, compress_frame, frame, 0, 0);
+
+  return 0;
+}
+
+struct codec_frame_writer* codec_frame_writer_open(int id, int level, int fast_id, size_t frame_size, struct threadpool* pool, FILE* out)
+{
+  const struct codec_info* info = codec_info(id);
+  struct codec_frame_writer* w;
+
+  if (info == NULL || !info->available || level < info->min_level || level > info->max_level || frame_size == 0)
+    return NULL;
+  if (fast_id >= 0 && (codec_info(fast_id) == NULL || !codec_info(fast_id)->available))
+    return NULL;
+  if ((w = calloc(1, sizeof(*w))) == NULL)
+    return NULL;
+
+  w->id = id;
+  w->level = level;
+  w->fast_id = fast_id;
+  w->frame_size = frame_size;
+  w->pool = pool;
+  w->out = out;
+
+  return w;
+}
+
+int codec_frame_write(struct codec_frame_writer* w, const void* buffer, size_t size)
+{
+  const uint8_t* p = buffer;
+
+  while (size > 0)
+  {
+    size_t n;
+
+    if (w->current == NULL && (w->current = malloc(w->frame_size)) == NULL)
+      return -1;
+
+    n = MIN(size, w->frame_size - w->used);
+    memcpy(w->current + w->used, p, n);
+    w->used += n;
+    p += n;
+    size -= n;
+
+    if (w->used == w->frame_size && submit_frame(w))
+      return -1;
+  }
+
+  return 0;
+}
+
+int codec_frame_writer_close(struct codec_frame_writer* w, FILE* f)
+{
+  uint8_t buf[16];
+  size_t k;
+  int result = 0;
+
+  if (w->used > 0 && submit_frame(w))
+    result = -1;
+  if (w->pool != NULL)
+    threadpool_wait(w->pool);
+  flush_frames(w, w->count);
+  if (w->status)
+    result = -1;
+
+  put64(w->count, buf);
+  if (fwrite(buf, 8, 1, f) != 1)
+    result = -1;
+  for (k = 0; k < w->count && result == 0; k++)
+  {
+    put64(w->frames[k]->size, buf);
+    put64(w->frames[k]->rawsize, buf + 8);
+    if (fwrite(buf, 16, 1, f) != 1)
+      result = -1;
+  }
+
+  for (k = 0; k < w->count; k++)
+    free_frame(w->frames[k]);
+  free(w->frames);
+  free(w->current);
+  free(w);
+
+  return result;
+}
+
+struct codec_frame_reader
+{
+  struct threadpool* pool;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;    // Signaled when a frame is done
+  struct codec_frame* frames;
+  uint64_t count;
+  uint64_t next;          // First frame not queued yet
+  uint64_t current;       // Frame being consumed
+  size_t pos;
+  uint64_t ahead;
+};
+
+// Decompress frame->in into frame->raw, on any thread
+static void decompress_frame(struct codec_frame* frame)
+{
+  const int id = (frame->size > 0) ? frame->in[0] : -1;
+  struct codec_reader* reader;
+
+  frame->status = -1;
+
+  // Stored frames are used in place
+  if (id == CODEC_STORE)
+  {
+    if (frame->size - 1 == frame->rawsize)
+    {
+      frame->out = frame->in + 1;
+      frame->status = 0;
+    }
+    return;
+  }
+
+  if ((frame->raw = malloc(frame->rawsize + 1)) != NULL && (reader = codec_reader_open_mem(id, frame->in + 1, frame->size - 1)) != NULL)
+  {
+    if (codec_read(reader, frame->raw, frame->rawsize) == 0)
+      frame->status = 0;
+    codec_reader_close(reader);
+  }
+  frame->out = frame->raw;
+}
+
+static void decompress_task(void* ctx, int64_t index, int64_t unused)
+{
+  struct codec_frame_reader* r = ctx;
+  struct codec_frame* frame = &r->frames[index];
+
+  (void)unused;
+
+  // The reader may have got to it first
+  pthread_mutex_lock(&r->lock);
+  if (frame->state != FRAME_QUEUED)
+  {
+    pthread_mutex_unlock(&r->lock);
+    return;
+  }
+  frame->state = FRAME_RUNNING;
+  pthread_mutex_unlock(&r->lock);
+
+  decompress_frame(frame);
+
+  pthread_mutex_lock(&r->lock);
+  frame->state = FRAME_DONE;
+  pthread_cond_broadcast(&r->cond);
+  pthread_mutex_unlock(&r->lock);
+}
+
+// Queue the next frame for decompression
+static void queue_frame(struct codec_frame_reader* r)
+{
+  r->frames[r->next].state = FRAME_QUEUED;
+  if (r->pool != NULL)
+    threadpool_submit(r->pool, decompress_task, r, r->next, 0);
+  r->next++;
+}
+
+// Wait for a frame, or decompress it here if no thread has started on it
+static int wait_frame(struct codec_frame_reader* r, struct codec_frame* frame)
+{
+  pthread_mutex_lock(&r->lock);
+  if (frame->state == FRAME_QUEUED)
+  {
+    frame->state = FRAME_RUNNING;
+    pthread_mutex_unlock(&r->lock);
+    decompress_frame(frame);
+    pthread_mutex_lock(&r->lock);
+    frame->state = FRAME_DONE;
+  }
+  while (frame->state != FRAME_DONE)
+    pthread_cond_wait(&r->cond, &r->lock);
+  pthread_mutex_unlock(&r->lock);
+
+  return frame->status;
+}
+
+struct codec_frame_reader* codec_frame_reader_open(const void* data, size_t size, struct threadpool* pool)
+{
+  const uint8_t* table = data;
+  const uint8_t* frame;
+  struct codec_frame_reader* r;
+  uint64_t k;
+
+  if (size < 8 || get64(table) > (size - 8) / 16)
+    return NULL;
+  if ((r = calloc(1, sizeof(*r))) == NULL)
+    return NULL;
+
+  r->pool = pool;
+  r->count = get64(table);
+  r->ahead = (pool != NULL) ? (uint64_t)threadpool_threads(pool) * FRAMES_AHEAD : 1;
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->cond, NULL);
+
+  if (r->count > SIZE_MAX / sizeof(struct codec_frame) || (r->frames = calloc(r->count + 1, sizeof(struct codec_frame))) == NULL)
+  {
+    codec_frame_reader_close(r);
+    return NULL;
+  }
+  // Frames follow the table, and must all be within size
+  table += 8;
+  frame = table + 16 * r->count;
+  size -= 8 + 16 * r->count;
+  for (k = 0; k < r->count; k++, table += 16)
+  {
+    if (get64(table) > size || get64(table + 8) > SIZE_MAX - 1)
+    {
+      codec_frame_reader_close(r);
+      return NULL;
+    }
+    r->frames[k].in = frame;
+    r->frames[k].size = get64(table);
+    r->frames[k].rawsize = get64(table + 8);
+    frame += r->frames[k].size;
+    size -= r->frames[k].size;
+  }
+
+  return r;
+}
+
+int codec_frame_read(struct codec_frame_reader* r, void* buffer, size_t size)
+{
+  uint8_t* p = buffer;
+
+  while (size > 0)
+  {
+    struct codec_frame* frame = &r->frames[r->current];
+    size_t n;
+
+    if (r->current == r->count)
+      return -1;
+
+    // Keep the threads busy with the next frames
+    while (r->next < r->count && r->next - r->current < r->ahead)
+      queue_frame(r);
+    if (wait_frame(r, frame))
+      return -1;
+
+    n = MIN(size, frame->rawsize - r->pos);
+    memcpy(p, frame->out + r->pos, n);
+    r->pos += n;
+    p += n;
+    size -= n;
+
+    if (r->pos == frame->rawsize)
+    {
+      free(frame->raw);
+      frame->raw = NULL;
+      r->current++;
+      r->pos = 0;
+    }
+  }
+
+  return 0;
+}
+
+void codec_frame_reader_close(struct codec_frame_reader* r)
+{
+  uint64_t k;
+
+  // Tasks still queued hold a pointer to r
+  if (r->pool != NULL)
+    threadpool_wait(r->pool);
+
+  if (r->frames != NULL)
+  {
+    for (k = 0; k < r->count; k++)
+      free(r->frames[k].raw);
+    free(r->frames);
+  }
+  pthread_cond_destroy(&r->cond);
+  pthread_mutex_destroy(&r->lock);
+  free(r);
+}
@@ -0,0 +1,122 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CODEC_H
+# define CODEC_H
+
+# include <stddef.h>
+# include <stdio.h>
+
+/*
+ * Compression of the patch files written by the bsdiff tool and read by the
+ * bspatch tool. The libraries only deal with streams, so none of this is
+ * needed to embed them.
+ *
+ * zstd and lz4 are optional: build with WITH_ZSTD and WITH_LZ4 defined (and
+ * the matching library) to enable them.
+ */
+
+/* Stored in patch headers, never renumber */
+enum codec_id
+{
+  CODEC_STORE = 0,
+  CODEC_BZIP2 = 1,
+  CODEC_ZSTD  = 2, /* With long distance matching */
+  CODEC_LZ4   = 3,
+  CODEC_COUNT
+};
+
+struct codec_info
+{
+  const char* name;
+  int available;     /* Whether this build supports it */
+  int min_level;
+  int max_level;
+  int default_level;
+};
+
+/* NULL if id is not a known codec */
+const struct codec_info* codec_info(int id);
+/* -1 if name is not a known codec */
+int codec_find(const char* name);
+
+/* Compress everything written to a codec_writer to f, up to
+ * codec_writer_close(). Functions returning int return 0 on success. */
+struct codec_writer;
+struct codec_writer* codec_writer_open(int id, int level, FILE* f);
+int codec_write(struct codec_writer* w, const void* buffer, size_t size);
+/* Finish the compressed stream and free w, even on failure */
+int codec_writer_close(struct codec_writer* w);
+
+/* Decompress from f, which must be positioned at the start of the
+ * compressed stream, or straight from size bytes of memory at data, which
+ * must stay valid until codec_reader_close(). codec_read() fails if it
+ * cannot read size bytes. */
+struct codec_reader;
+struct codec_reader* codec_reader_open(int id, FILE* f);
+struct codec_reader* codec_reader_open_mem(int id, const void* data, size_t size);
+int codec_read(struct codec_reader* r, void* buffer, size_t size);
+void codec_reader_close(struct codec_reader* r);
+
+/*
+ * Framed compression: the data is cut into frames of frame_size bytes that
+ * are compressed independently, several at a time when given a thread pool.
+ * The framed stream is:
+ *   the number of frames
+ *   the compressed and decompressed size of each frame
+ *   the frames, in order, each one a codec id byte and the compressed data
+ * with every number on 8 bytes, little endian.
+ *
+ * The codec of each frame is picked from the entropy of a sample: frames
+ * that look random are stored, frames that look nearly so use fast_id at
+ * its lowest level (unless fast_id is -1), the others use id and level.
+ */
+struct threadpool;
+
+struct codec_frame_writer;
+/*
+ * The frames are written to out, in order, as soon as they are compressed,
+ * so that only a few of them are held in memory at a time.
+ */
+struct codec_frame_writer* codec_frame_writer_open(int id, int level, int fast_id, size_t frame_size, struct threadpool* pool, FILE* out);
+int codec_frame_write(struct codec_frame_writer* w, const void* buffer, size_t size);
+/*
+ * Write the number of frames and their sizes to f and free w, even on
+ * failure. The framed stream is f followed by out.
+ */
+int codec_frame_writer_close(struct codec_frame_writer* w, FILE* f);
+
+/* Frames are decompressed from the size bytes at data, ahead of
+ * codec_frame_read() on the thread pool if any. Stored frames are copied
+ * straight from data, which must stay valid until codec_frame_reader_close().
+ * The pool must not be waited on by anyone else until then. */
+struct codec_frame_reader;
+struct codec_frame_reader* codec_frame_reader_open(const void* data, size_t size, struct threadpool* pool);
+int codec_frame_read(struct codec_frame_reader* r, void* buffer, size_t size);
+void codec_frame_reader_close(struct codec_frame_reader* r);
+
+#endif
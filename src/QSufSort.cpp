@@ -1,29 +1,31 @@
-#include <iostream>
-
 #include "QSufSort.hpp"
 
-static void swap(int64_t& a, int64_t& b)
+template <typename Index>
+static void swap(Index& a, Index& b)
 {
-  int64_t tmp = a;
+  Index tmp = a;
   a = b;
   b = tmp;
 }
 
-QSufSort::QSufSort()
+template <typename Index>
+QSufSort<Index>::QSufSort()
   : I (nullptr)
   , V (nullptr)
 {
 }
 
-QSufSort::~QSufSort()
+template <typename Index>
+QSufSort<Index>::~QSufSort()
 {
   delete[] I;
   delete[] V;
 }
 
-void QSufSort::applySpecial(int64_t start, int64_t nLower, int64_t nEqual)
+template <typename Index>
+void QSufSort<Index>::applySpecial(Index start, Index nLower, Index nEqual)
 {
-  for (int64_t i = 0; i < nEqual; i++)
+  for (Index i = 0; i < nEqual; i++)
     V[I[start + nLower + i]] = start + nLower + nEqual - 1;
 
   // If there is only one value that was "equal", then it is sorted, we signal it.
@@ -32,14 +34,15 @@ void QSufSort::applySpecial(int64_t start, int64_t nLower, int64_t nEqual)
 }
 
 // Put all the occurences of the lowest value of the array on its left side and returns its number of occurence
-int64_t QSufSort::sortLowestValue(int64_t* subV, int64_t* subI, int64_t limit)
+template <typename Index>
+Index QSufSort<Index>::sortLowestValue(Index* subV, Index* subI, Index limit)
 {
-  int64_t x = subV[subI[0]];
-  int64_t j = 1;
+  Index x = subV[subI[0]];
+  Index j = 1;
 
-  for (int64_t i = 1; i < limit; i++)
+  for (Index i = 1; i < limit; i++)
   {
-    int64_t val = subV[subI[i]];
+    Index val = subV[subI[i]];
 
     // We found a new lowest value, so we set the destination of the swap() to come.
     if (val < x)
@@ -51,7 +54,6 @@ int64_t QSufSort::sortLowestValue(int64_t* subV, int64_t* subI, int64_t limit)
     // Swap the value to the next free spot on the left side of the array.
     if (val == x)
     {
-      std::cout << "swap(" << i << ", " << j << ")" << std::endl;
       swap(subI[i], subI[j]);
       j++;
     }
@@ -62,12 +64,13 @@ int64_t QSufSort::sortLowestValue(int64_t* subV, int64_t* subI, int64_t limit)
 
 // Has the same result as split(), but more adapted to low size arrays (kind of Select Sort).
 // h indicates the key to use : key = V[i + h] for suffix i.
-void QSufSort::splitEasy(int64_t start, int64_t len, int64_t h)
+template <typename Index>
+void QSufSort<Index>::splitEasy(Index start, Index len, Index h)
 {
-  int64_t  nEqual = 0;
-  int64_t* subI = I + start;
+  Index  nEqual = 0;
+  Index* subI = I + start;
 
-  for (int64_t nLower = 0; nLower < len; nLower += nEqual)
+  for (Index nLower = 0; nLower < len; nLower += nEqual)
   {
     // Put the lowest values of the array on its left.
     nEqual = sortLowestValue(V + h, subI + nLower, len - nLower);
@@ -75,11 +78,12 @@ void QSufSort::splitEasy(int64_t start, int64_t len, int64_t h)
   }
 }
 
-QSufSort::PairOfInt QSufSort::countLowerAndEqual(int64_t* subV, int64_t* subI, int64_t len, int64_t x)
+template <typename Index>
+typename QSufSort<Index>::PairOfInt QSufSort<Index>::countLowerAndEqual(Index* subV, Index* subI, Index len, Index x)
 {
   PairOfInt ret(0, 0);
 
-  for (int64_t i = 0; i < len; i++)
+  for (Index i = 0; i < len; i++)
   {
     if (subV[subI[i]] < x)
       ret.first++;
@@ -92,9 +96,10 @@ QSufSort::PairOfInt QSufSort::countLowerAndEqual(int64_t* subV, int64_t* subI, i
 
 // Range les valeurs de I de sorte à ce que les valeurs inférieures au pivot soient à gauche
 // que celles égales soient au milieu, que celles supérieures soient à droite.
-void QSufSort::applyPivot(int64_t* subV, int64_t* subI, const PairOfInt& leCounts, int64_t pivot)
+template <typename Index>
+void QSufSort<Index>::applyPivot(Index* subV, Index* subI, const PairOfInt& leCounts, Index pivot)
 {
-  int64_t i = 0;
+  Index i = 0;
   PairOfInt ehCounts(0, 0);
 
   // Browse the "lower" part of the array.
@@ -116,7 +121,7 @@ void QSufSort::applyPivot(int64_t* subV, int64_t* subI, const PairOfInt& leCount
   }
 
   // Browse the "equals" part of the array, put the values "higher" in their part.
-  int64_t* subSubI = subI + leCounts.first;
+  Index* subSubI = subI + leCounts.first;
   while (ehCounts.first < leCounts.second)
   {
     if (subV[subSubI[ehCounts.first]] == pivot)
@@ -133,19 +138,18 @@ void QSufSort::applyPivot(int64_t* subV, int64_t* subI, const PairOfInt& leCount
 }
 
 // This is a kind of Quick Sort with some special treatment
-void QSufSort::split(int64_t start, int64_t len, int64_t h)
+template <typename Index>
+void QSufSort<Index>::split(Index start, Index len, Index h)
 {
-  std::cout << "split(" << start << ", " << len << ", " << h << ")" << std::endl;
-
   if (len < 16)
     return splitEasy(start, len, h);
 
   // Helper variables
-  int64_t* subI = I + start;
-  int64_t* subV = V + h;
+  Index* subI = I + start;
+  Index* subV = V + h;
 
   // Select a pivot
-  int64_t  pivot = subV[subI[len / 2]];
+  Index  pivot = subV[subI[len / 2]];
 
   // Get the number of values lower and equal to our pivot.
   PairOfInt leCounts = countLowerAndEqual(subV, subI, len, pivot);
@@ -181,21 +185,21 @@ void fillCounters(const uint8_t* array, int64_t size, int64_t* combinedCounters)
     combinedCounters[i] = combinedCounters[i - 1] + counters[i - 1];
 }
 
-void QSufSort::fillIandV(const uint8_t* array, int64_t size)
+template <typename Index>
+void QSufSort<Index>::fillIandV(const uint8_t* array, int64_t size)
 {
   int64_t combinedCounters[256] = {0};
   fillCounters(array, size, combinedCounters);
 
-  // Huge allocation.
-  // TODO : think about using int32_t, for memory usage optimisation
-  I = new int64_t[size + 1];
-  V = new int64_t[size + 1];
+  // Huge allocation, hence the choice of Index (see fits()).
+  I = new Index[size + 1];
+  V = new Index[size + 1];
 
   // I contains the index of each byte of the array in order to sort it.
   // combinedCounters is shifted one step to the left in this operation. Trust me.
   // It means that each byte of combinedCounters gives the number of elements in the array
   // that are lower *or equal* than its index.
-  for (int64_t i = 0; i < size; i++)
+  for (Index i = 0; i < size; i++)
   {
     int64_t& index = combinedCounters[array[i]];
     index++;
@@ -205,7 +209,7 @@ void QSufSort::fillIandV(const uint8_t* array, int64_t size)
 
   // V[i] indicates the last position in I that points to a suffix having the same first letter as array[i].
   V[size] = 0;
-  for (int64_t i = 0; i < size; i++)
+  for (Index i = 0; i < size; i++)
     V[i] = combinedCounters[array[i]];
 
   // In the (few) cases where a specific byte appears only once,
@@ -228,7 +232,8 @@ void QSufSort::fillIandV(const uint8_t* array, int64_t size)
  * The expected result would be the starting index of each suffix : [5, 1, 3, 0, 2, 4]
  * That's what we put in the array I.
  */
-void QSufSort::sort(const uint8_t* array, int64_t size)
+template <typename Index>
+void QSufSort<Index>::sort(const uint8_t* array, int64_t size)
 {
   /* The first step would be to sort the array (in I). It is logical as we wan't a
    * sorted list of prefixes. Once sorted, BABAR becomes AABBR. However,
@@ -248,11 +253,13 @@ void QSufSort::sort(const uint8_t* array, int64_t size)
    * in I to look at if we want to know the position of suffix n.
    */
 
+  // h stays 64-bit: with a 32-bit Index, doubling it after the last round
+  // would overflow. Any h used in a round is below size.
   for (int64_t h = 1; I[0] != -(size + 1); h *= 2)
   {
     // h = 1, 2, 4, 8, 16, 32...
-    int64_t len = 0;
-    int64_t i = 0;
+    Index len = 0;
+    Index i = 0;
 
     while (i < size + 1)
     {
@@ -274,7 +281,7 @@ void QSufSort::sort(const uint8_t* array, int64_t size)
         // (its last index) - (current index) + 1
         // The last index of the current unsorted group is given in V.
         len = V[I[i]] - i + 1;
-        split(i, len, h);
+        split(i, len, (Index)h);
         i += len;
         len = 0;
       }
@@ -284,6 +291,9 @@ void QSufSort::sort(const uint8_t* array, int64_t size)
   }
 
   // Rebuild I (that contains only negative numbers) from data available in V
-  for (int64_t i = 0; i < size + 1; i++)
+  for (Index i = 0; i < size + 1; i++)
     I[V[i]] = i;
 }
+
+template class QSufSort<int32_t>;
+template class QSufSort<int64_t>;
@@ -1,6 +1,11 @@
 #include <cstdint>
+#include <limits>
 #include <utility>
 
+// Index is the integer type used for the suffix array and its companion V.
+// int32_t halves the memory footprint and is enough for arrays shorter than
+// 2^31 - 1 bytes; see fits() and qsufsort() below.
+template <typename Index>
 class QSufSort
 {
 public:
@@ -8,21 +13,48 @@ public:
   ~QSufSort();
 
   void sort(const uint8_t* array, int64_t size);
+
+  // Suffix array computed by sort(): size + 1 entries, the first one being the empty suffix.
+  const Index* result() const { return I; }
+
+  // Whether Index can hold every value used while sorting an array of this size.
+  static bool fits(int64_t size) { return size < std::numeric_limits<Index>::max(); }
 private:
-  typedef std::pair<int64_t, int64_t> PairOfInt;
+  typedef std::pair<Index, Index> PairOfInt;
 
-  void      applySpecial(int64_t start, int64_t nLower, int64_t nEqual);
-  int64_t   sortLowestValue(int64_t* subV, int64_t* subI, int64_t limit);
-  void      splitEasy(int64_t start, int64_t len, int64_t h);
-  PairOfInt countLowerAndEqual(int64_t* subV, int64_t* subI, int64_t len, int64_t x);
-  void      applyPivot(int64_t* subV, int64_t* subI, const PairOfInt& leCounts, int64_t pivot);
+  void      applySpecial(Index start, Index nLower, Index nEqual);
+  Index     sortLowestValue(Index* subV, Index* subI, Index limit);
+  void      splitEasy(Index start, Index len, Index h);
+  PairOfInt countLowerAndEqual(Index* subV, Index* subI, Index len, Index x);
+  void      applyPivot(Index* subV, Index* subI, const PairOfInt& leCounts, Index pivot);
   void      fillIandV(const uint8_t* array, int64_t size);
 
-  void      split(int64_t start, int64_t len, int64_t h);
+  void      split(Index start, Index len, Index h);
 
 private:
-  int64_t* I;
-  int64_t* L;
-  int64_t* V;
+  Index* I;
+  Index* L;
+  Index* V;
 };
 
+typedef QSufSort<int32_t> QSufSort32;
+typedef QSufSort<int64_t> QSufSort64;
+
+// Sort the suffixes of array with 32-bit indexes when possible, 64-bit ones otherwise,
+// then call visitor(I) with the resulting suffix array (int32_t* or int64_t*).
+template <typename Visitor>
+void qsufsort(const uint8_t* array, int64_t size, Visitor visitor)
+{
+  if (QSufSort32::fits(size))
+  {
+    QSufSort32 sorter;
+    sorter.sort(array, size);
+    visitor(sorter.result());
+  }
+  else
+  {
+    QSufSort64 sorter;
+    sorter.sort(array, size);
+    visitor(sorter.result());
+  }
+}
@@ -0,0 +1,314 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "threadpool.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct tp_task
+{
+  threadpool_task fn;
+  void* ctx;
+  int64_t a;
+  int64_t b;
+};
+
+// tasks[head, tail) are queued. The owner pushes and pops at the tail,
+// thieves take from the head.
+struct tp_deque
+{
+  pthread_mutex_t lock;
+  struct tp_task* tasks;
+  size_t head;
+  size_t tail;
+  size_t capacity;
+};
+
+struct tp_worker
+{
+  struct threadpool* pool;
+  int self;
+};
+
+struct threadpool
+{
+  int threads;
+  pthread_t* ids;           // threads - 1 workers
+  struct tp_worker* workers;
+  struct tp_deque* deques;  // One per thread, the last one is used by threadpool_wait()
+  pthread_mutex_t lock;
+  pthread_cond_t cond;      // Signaled when a task is queued or pending reaches 0
+  int64_t pending;          // Submitted but not completed
+  int64_t queued;           // Sitting in a deque
+  int shutdown;
+};
+
+static __thread struct tp_worker tp_current = { NULL, 0 };
+
+static int tp_self(const struct threadpool* pool)
+{
+  if (tp_current.pool == pool)
+    return tp_current.self;
+
+  return pool->threads - 1;
+}
+
+static int tp_push(struct tp_deque* d, const struct tp_task* task)
+{
+  int result = 0;
+
+  pthread_mutex_lock(&d->lock);
+  if (d->tail == d->capacity)
+  {
+    if (d->head > 0)
+    {
+      memmove(d->tasks, d->tasks + d->head, (d->tail - d->head) * sizeof(struct tp_task));
+      d->tail -= d->head;
+      d->head = 0;
+    }
+    else
+    {
+      size_t capacity = d->capacity ? d->capacity * 2 : 64;
+      struct tp_task* tasks = realloc(d->tasks, capacity * sizeof(struct tp_task));
+      if (tasks == NULL)
+        result = -1;
+      else
+      {
+        d->tasks = tasks;
+        d->capacity = capacity;
+      }
+    }
+  }
+  if (result == 0)
+    d->tasks[d->tail++] = *task;
+  pthread_mutex_unlock(&d->lock);
+
+  return result;
+}
+
+static int tp_take(struct tp_deque* d, int steal, struct tp_task* task)
+{
+  int found = 0;
+
+  pthread_mutex_lock(&d->lock);
+  if (d->head < d->tail)
+  {
+    *task = steal ? d->tasks[d->head++] : d->tasks[--d->tail];
+    if (d->head == d->tail)
+      d->head = d->tail = 0;
+    found = 1;
+  }
+  pthread_mutex_unlock(&d->lock);
+
+  return found;
+}
+
+// Pop one of our own tasks, or steal one from another thread.
+static int tp_next(struct threadpool* pool, int self, struct tp_task* task)
+{
+  int i;
+
+  if (tp_take(&pool->deques[self], 0, task))
+    return 1;
+
+  for (i = 1; i < pool->threads; i++)
+    if (tp_take(&pool->deques[(self + i) % pool->threads], 1, task))
+      return 1;
+
+  return 0;
+}
+
+static void tp_run(struct threadpool* pool, const struct tp_task* task)
+{
+  pthread_mutex_lock(&pool->lock);
+  pool->queued--;
+  pthread_mutex_unlock(&pool->lock);
+
+  task->fn(task->ctx, task->a, task->b);
+
+  pthread_mutex_lock(&pool->lock);
+  if (--pool->pending == 0)
+    pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static void* tp_worker_main(void* arg)
+{
+  struct tp_worker* worker = arg;
+  struct threadpool* pool = worker->pool;
+  struct tp_task task;
+
+  tp_current = *worker;
+  for (;;)
+  {
+    if (tp_next(pool, worker->self, &task))
+    {
+      tp_run(pool, &task);
+      continue;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->queued == 0 && !pool->shutdown)
+      pthread_cond_wait(&pool->cond, &pool->lock);
+    if (pool->queued == 0 && pool->shutdown)
+    {
+      pthread_mutex_unlock(&pool->lock);
+      break;
+    }
+    pthread_mutex_unlock(&pool->lock);
+  }
+
+  return NULL;
+}
+
+static void tp_free(struct threadpool* pool, int started)
+{
+  int i;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = 1;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (i = 0; i < started; i++)
+    pthread_join(pool->ids[i], NULL);
+
+  for (i = 0; i < pool->threads; i++)
+  {
+    pthread_mutex_destroy(&pool->deques[i].lock);
+    free(pool->deques[i].tasks);
+  }
+  pthread_cond_destroy(&pool->cond);
+  pthread_mutex_destroy(&pool->lock);
+
+  free(pool->deques);
+  free(pool->workers);
+  free(pool->ids);
+  free(pool);
+}
+
+struct threadpool* threadpool_create(int threads)
+{
+  struct threadpool* pool;
+  int i;
+
+  if (threads < 1)
+    threads = 1;
+
+  if ((pool = calloc(1, sizeof(*pool))) == NULL)
+    return NULL;
+
+  pool->threads = threads;
+  pool->ids = calloc(threads, sizeof(pthread_t));
+  pool->workers = calloc(threads, sizeof(struct tp_worker));
+  pool->deques = calloc(threads, sizeof(struct tp_deque));
+  if (pool->ids == NULL || pool->workers == NULL || pool->deques == NULL)
+  {
+    free(pool->deques);
+    free(pool->workers);
+    free(pool->ids);
+    free(pool);
+    return NULL;
+  }
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+  for (i = 0; i < threads; i++)
+    pthread_mutex_init(&pool->deques[i].lock, NULL);
+
+  for (i = 0; i < threads - 1; i++)
+  {
+    pool->workers[i].pool = pool;
+    pool->workers[i].self = i;
+    if (pthread_create(&pool->ids[i], NULL, tp_worker_main, &pool->workers[i]) != 0)
+    {
+      tp_free(pool, i);
+      return NULL;
+    }
+  }
+
+  return pool;
+}
+
+void threadpool_destroy(struct threadpool* pool)
+{
+  if (pool != NULL)
+    tp_free(pool, pool->threads - 1);
+}
+
+int threadpool_threads(const struct threadpool* pool)
+{
+  return pool->threads;
+}
+
+void threadpool_submit(struct threadpool* pool, threadpool_task fn, void* ctx, int64_t a, int64_t b)
+{
+  struct tp_task task = { fn, ctx, a, b };
+
+  pthread_mutex_lock(&pool->lock);
+  pool->pending++;
+  pool->queued++;
+  pthread_mutex_unlock(&pool->lock);
+
+  if (tp_push(&pool->deques[tp_self(pool)], &task) == 0)
+  {
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    return;
+  }
+
+  // Out of memory: run it ourselves
+  tp_run(pool, &task);
+}
+
+void threadpool_wait(struct threadpool* pool)
+{
+  const int self = tp_self(pool);
+  struct tp_task task;
+
+  for (;;)
+  {
+    if (tp_next(pool, self, &task))
+    {
+      tp_run(pool, &task);
+      continue;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->pending == 0)
+    {
+      pthread_mutex_unlock(&pool->lock);
+      return;
+    }
+    if (pool->queued == 0)
+      pthread_cond_wait(&pool->cond, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
@@ -0,0 +1,59 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef THREADPOOL_H
+# define THREADPOOL_H
+
+# include <stdint.h>
+
+/*
+ * Minimal work-stealing thread pool. Every thread owns a deque of tasks: it
+ * pops its own tasks last-in first-out, and steals the oldest tasks of the
+ * other threads when it runs out. Tasks are plain ranges, so that splitting
+ * work never needs an allocation: fn(ctx, a, b).
+ */
+
+struct threadpool;
+
+typedef void (*threadpool_task)(void* ctx, int64_t a, int64_t b);
+
+/* Create a pool of `threads` threads in total, the one calling
+ * threadpool_wait() included. Returns NULL on failure. */
+struct threadpool* threadpool_create(int threads);
+void threadpool_destroy(struct threadpool* pool);
+
+int threadpool_threads(const struct threadpool* pool);
+
+/* Queue fn(ctx, a, b). Tasks may submit more tasks. If the task cannot be
+ * queued, it is run right away on the calling thread. */
+void threadpool_submit(struct threadpool* pool, threadpool_task fn, void* ctx, int64_t a, int64_t b);
+
+/* Run tasks on the calling thread until every submitted task (and the ones
+ * they submitted) has completed. Must not be called from inside a task. */
+void threadpool_wait(struct threadpool* pool);
+
+#endif